@@ -1,3 +1,302 @@
+enum LatencyKind {
+    LATENCY_ACKED,          // enqueue to I-ACK/B-ACK reception at the sender
+    LATENCY_DELIVERED,      // enqueue to delivery at the hub
+    LATENCY_DROPPED,        // enqueue to drop
+};
+
+enum AccessMode {
+    ACCESS_RAP,
+    ACCESS_SCHEDULED,
+    ACCESS_POLLED,
+    ACCESS_POSTED,
+};
+
+// Define the superframe periods and their durations
+enum SuperframePeriod {
+    EAP_PERIOD, // TDMA period for P1 (UP=7) packets (Emergency category)
+    RAP_PERIOD, // CSMA/CA period for P2 (UP4, UP5, UP6) packets (Dependent category)
+    CAP_PERIOD, // CSMA/CA period for P3 (UP0, UP1, UP2, UP3) packets (Independent category)
+    MANAGED_PERIOD, // Scheduled, polled and posted access, no contention
+};
+
+// Integer hash (multiplicative, then xor-shift mixed) used for deterministic join decisions
+static unsigned int joinHash(int address, int salt) {
+    unsigned int h = (unsigned int)address * 2654435761u ^ (unsigned int)salt * 40503u;
+    h ^= h >> 16;
+    h *= 0x45d9f3bu;
+    h ^= h >> 16;
+    return h;
+}
+
+// Size of the per NID hub arrays (lastTxAccessSlot, reqToSendMoreData), indexed by connected NID
+static const int HUB_NID_TABLE_SIZE = 216;
+
+// Bytes a batched connection assignment adds to the beacon (address, status, NID, uplink and downlink slots)
+static const int BEACON_ASSIGNMENT_ENTRY_SIZE = 8;
+// Bytes an announced slot length / beacon period change adds to the beacon (countdown, slot length, period)
+static const int BEACON_PARAMETER_CHANGE_SIZE = 4;
+
+/* Allocation slot after the hub changed its superframe: rescaled by factor (old over
+ * new slot length), then moved by shift slots with the end of RAP. Slots are numbered from 1.
+ */
+static int moveSlot(int slot, double factor, int shift) {
+    return (int)floor((slot - 1) * factor + 0.5) + 1 + shift;
+}
+
+enum BufferOverflowPolicy {
+    BUFFER_TAIL_DROP,
+    BUFFER_DROP_LOWEST_UP,
+    BUFFER_DROP_OLDEST,
+};
+
+/* HubScheduleManager owns the hub's superframe layout as a dense array indexed by
+ * allocation slot (1..beaconPeriodLength). Every slot records its owner NID, the
+ * direction of the traffic (uplink: hub receives, downlink: hub transmits) and the
+ * phase it belongs to. Two derived arrays, nextAllocated and runEndSlot, are
+ * refreshed backwards from the last changed slot on every assignment change, down
+ * to where they stop changing. The allocated slot count and the first/end slot per
+ * direction are kept up to date slot by slot as owners change. All queries made
+ * during a superframe are simple array lookups.
+ */
+enum SlotDirection {
+    SLOT_UNUSED,
+    SLOT_UPLINK,
+    SLOT_DOWNLINK,
+};
+
+enum SlotPhase {
+    SLOT_PHASE_FREE,
+    SLOT_PHASE_EAP,
+    SLOT_PHASE_RAP,
+    SLOT_PHASE_SCHEDULED,
+    SLOT_PHASE_POLL,
+    SLOT_PHASE_CAP,
+};
+
+struct SlotOwner {
+    int NID;                    // owner of the slot, BROADCAST_NID for contention phases
+    SlotDirection direction;
+    SlotPhase phase;
+};
+
+class HubScheduleManager {
+  public:
+    HubScheduleManager() : length(0), capStartSlot(1), allocated(0) {
+        for (int d = 0; d < 3; d++) { firstSlotOf[d] = 1; endSlotOf[d] = 0; countOf[d] = 0; }
+    }
+
+    // Lay out an empty superframe: EAP1 and RAP1 after the beacon, CAP at the end
+    void reset(int beaconPeriodLength, int eapSlots, int RAP1Length, int capSlots) {
+        length = beaconPeriodLength;
+        capStartSlot = length - capSlots + 1;
+        SlotOwner freeSlot = { BROADCAST_NID, SLOT_UNUSED, SLOT_PHASE_FREE };
+        slots.assign(length + 2, freeSlot);
+        nextAllocated.assign(length + 2, length + 1);
+        runEndSlot.assign(length + 2, length + 1);
+        allocated = 0;
+        for (int d = 0; d < 3; d++) { firstSlotOf[d] = length + 1; endSlotOf[d] = 0; countOf[d] = 0; }
+        mark(BROADCAST_NID, SLOT_UPLINK, SLOT_PHASE_EAP, 1, eapSlots + 1);
+        mark(BROADCAST_NID, SLOT_UPLINK, SLOT_PHASE_RAP, eapSlots + 1, RAP1Length + 1);
+        mark(BROADCAST_NID, SLOT_UPLINK, SLOT_PHASE_CAP, length - capSlots + 1, length + 1);
+        refresh(1, length);
+    }
+
+    // Allocate slots [startSlot, endSlot) to NID. Same end semantics as scheduledTxAccessEnd
+    void assign(int NID, SlotDirection direction, SlotPhase phase, int startSlot, int endSlot) {
+        if (!mark(NID, direction, phase, startSlot, endSlot)) return;
+        refresh(max(startSlot, 1), min(endSlot - 1, length));
+    }
+
+    // Give back slots [startSlot, endSlot)
+    void release(int startSlot, int endSlot) {
+        if (!mark(BROADCAST_NID, SLOT_UNUSED, SLOT_PHASE_FREE, startSlot, endSlot)) return;
+        refresh(max(startSlot, 1), min(endSlot - 1, length));
+    }
+
+    // Polled allocations only last one superframe
+    void releasePolls() {
+        int first = 0, last = 0;
+        for (int i = 1; i <= length; i++) {
+            if (slots[i].phase != SLOT_PHASE_POLL) continue;
+            unaccount(i);
+            slots[i].NID = BROADCAST_NID;
+            slots[i].direction = SLOT_UNUSED;
+            slots[i].phase = SLOT_PHASE_FREE;
+            if (first == 0) first = i;
+            last = i;
+        }
+        if (last == 0) return;
+        fixBounds();
+        refresh(first, last);
+    }
+
+    const SlotOwner &owner(int slot) const { return slots[clamp(slot)]; }
+    // First slot >= slot that the hub has to be awake for, beaconPeriodLength+1 if none
+    int nextAllocatedSlot(int slot) const { return nextAllocated[clamp(slot)]; }
+    // First slot after the run of allocated slots of the same owner and direction that contains slot
+    int runEnd(int slot) const { return runEndSlot[clamp(slot)]; }
+    // Scheduled and polled allocations (not contention phases) per direction
+    bool hasSlots(SlotDirection direction) const { return endSlotOf[direction] > 0; }
+    int firstSlot(SlotDirection direction) const { return hasSlots(direction) ? firstSlotOf[direction] : 0; }
+    int endSlot(SlotDirection direction) const { return endSlotOf[direction]; }
+    // First slot of a run of count unallocated slots within [fromSlot, toSlot), -1 if there is none
+    int findFreeRun(int count, int fromSlot, int toSlot) const {
+        int runStart = -1;
+        for (int i = max(fromSlot, 1); i < min(toSlot, length + 1); i++) {
+            if (slots[i].phase != SLOT_PHASE_FREE) { runStart = -1; continue; }
+            if (runStart < 0) runStart = i;
+            if (i - runStart + 1 == count) return runStart;
+        }
+        return -1;
+    }
+    // Number of scheduled and polled slots
+    int allocatedSlots() const { return allocated; }
+    // Scheduled allocations must end before the CAP
+    int capStart() const { return capStartSlot; }
+
+  private:
+    int length;
+    int capStartSlot;
+    int allocated;
+    vector<SlotOwner> slots;
+    vector<int> nextAllocated;
+    vector<int> runEndSlot;
+    int firstSlotOf[3];
+    int endSlotOf[3];
+    int countOf[3];             // scheduled and polled slots per direction
+
+    int clamp(int slot) const { return slot < 1 ? 1 : (slot > length + 1 ? length + 1 : slot); }
+
+    bool mark(int NID, SlotDirection direction, SlotPhase phase, int startSlot, int endSlot) {
+        startSlot = max(startSlot, 1);
+        endSlot = min(endSlot, length + 1);
+        if (startSlot >= endSlot) return false;
+        for (int i = startSlot; i < endSlot; i++) {
+            unaccount(i);
+            slots[i].NID = NID;
+            slots[i].direction = direction;
+            slots[i].phase = phase;
+            account(i);
+        }
+        fixBounds();
+        return true;
+    }
+
+    bool isAllocation(int i, int direction) const {
+        return (slots[i].phase == SLOT_PHASE_SCHEDULED || slots[i].phase == SLOT_PHASE_POLL) && slots[i].direction == direction;
+    }
+
+    // Slot i joins (account) or leaves (unaccount) the scheduled and polled slots
+    void account(int i) {
+        int d = slots[i].direction;
+        if (!isAllocation(i, d)) return;
+        allocated++;
+        countOf[d]++;
+        firstSlotOf[d] = min(firstSlotOf[d], i);
+        endSlotOf[d] = max(endSlotOf[d], i + 1);
+    }
+
+    void unaccount(int i) {
+        int d = slots[i].direction;
+        if (!isAllocation(i, d)) return;
+        allocated--;
+        countOf[d]--;
+    }
+
+    // A first/end slot that was given away moves inwards to the nearest remaining allocation
+    void fixBounds() {
+        for (int d = SLOT_UPLINK; d <= SLOT_DOWNLINK; d++) {
+            if (countOf[d] == 0) { firstSlotOf[d] = length + 1; endSlotOf[d] = 0; continue; }
+            while (!isAllocation(firstSlotOf[d], d)) firstSlotOf[d]++;
+            while (!isAllocation(endSlotOf[d] - 1, d)) endSlotOf[d]--;
+        }
+    }
+
+    /* Recompute the derived arrays after slots [firstChanged, lastChanged] changed. Slots
+     * after lastChanged are unaffected, and below firstChanged the walk stops as soon as
+     * a slot's entries come out as they were, since every slot only depends on the next.
+     */
+    void refresh(int firstChanged, int lastChanged) {
+        for (int i = lastChanged; i >= 1; i--) {
+            int next, run;
+            if (slots[i].direction == SLOT_UNUSED) {
+                next = nextAllocated[i + 1];
+                run = i + 1;
+            } else {
+                next = i;
+                bool sameRun = slots[i + 1].direction == slots[i].direction && slots[i + 1].NID == slots[i].NID;
+                run = sameRun ? runEndSlot[i + 1] : i + 1;
+            }
+            if (i < firstChanged && next == nextAllocated[i] && run == runEndSlot[i]) break;
+            nextAllocated[i] = next;
+            runEndSlot[i] = run;
+        }
+    }
+};
+
+/* The hub's poll grants, ordered by start slot (a min-heap over a vector). Grants
+ * need not be contiguous, a grant can be cancelled before it starts, and a grant
+ * that continues another one of the same NID is merged into it. Same TimerInfo
+ * semantics as before: endSlot is the last slot of the grant.
+ */
+class PollTimeline {
+  public:
+    static int startOf(const TimerInfo &t) { return t.endSlot - t.slotsGiven + 1; }
+
+    bool empty() const { return grants.empty(); }
+    int size() const { return grants.size(); }
+    void clear() { grants.clear(); }
+    const TimerInfo &top() const { return grants.front(); }
+
+    void pop() {
+        pop_heap(grants.begin(), grants.end(), later);
+        grants.pop_back();
+    }
+
+    void push(const TimerInfo &t) {
+        for (unsigned int i = 0; i < grants.size(); i++) {
+            TimerInfo &g = grants[i];
+            if (g.NID != t.NID) continue;
+            if (g.endSlot + 1 == startOf(t)) {
+                g.slotsGiven += t.slotsGiven;
+                g.endSlot = t.endSlot;
+                return;        // start unchanged, heap order holds
+            }
+            if (t.endSlot + 1 == startOf(g)) {
+                g.slotsGiven += t.slotsGiven;
+                make_heap(grants.begin(), grants.end(), later);
+                return;
+            }
+        }
+        grants.push_back(t);
+        push_heap(grants.begin(), grants.end(), later);
+    }
+
+    // The grant of NID, NULL if it has none pending
+    const TimerInfo *grantOf(int NID) const {
+        for (unsigned int i = 0; i < grants.size(); i++)
+            if (grants[i].NID == NID) return &grants[i];
+        return NULL;
+    }
+
+    // Remove the pending grants of NID, the removed ones are returned
+    vector<TimerInfo> cancel(int NID) {
+        vector<TimerInfo> removed;
+        for (unsigned int i = 0; i < grants.size(); ) {
+            if (grants[i].NID != NID) { i++; continue; }
+            removed.push_back(grants[i]);
+            grants[i] = grants.back();
+            grants.pop_back();
+        }
+        if (!removed.empty()) make_heap(grants.begin(), grants.end(), later);
+        return removed;
+    }
+
+  private:
+    vector<TimerInfo> grants;
+    static bool later(const TimerInfo &a, const TimerInfo &b) { return startOf(a) > startOf(b); }
+};
+
 void BaselineBANMac::startup() {
     // Existing code...
 
@@ -13,14 +312,9 @@ void BaselineBANMac::startup() {
     int priorityLevel = 2;        // Default priority level (P2 - Medium)
     string trafficCategory = "Dependent"; // Default traffic category
 
-    int numFrequencyChannels = 16; // Default number of frequency channels for channel hopping
-    int channelHoppingSequence[] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16}; // Default channel hopping sequence
-
     bool enableSleepModes = true; // Enable sleep modes for energy efficiency
     double sleepInterval = 10.0;  // Default sleep interval in seconds
 
-    bool enableCoexistence = true; // Enable coexistence mechanisms
-
     // Existing code...
 
     // Assigning the new parameters
@@ -35,16 +329,216 @@ void BaselineBANMac::startup() {
     priorityLevel = getParentModule()->getParentModule()->getSubmodule("Application")->par("priority");
     trafficCategory = par("trafficCategory");
 
+    /* Channel hopping. The hopping sequence is a network wide parameter, the hub
+     * advertises in every beacon where in the sequence it is (hopping state) and
+     * how many beacon periods it stays on a channel. The carrier frequency of every
+     * hopping state is computed once here, so a hop is a table lookup.
+     */
+    channelHopping = par("channelHopping");
     numFrequencyChannels = par("numFrequencyChannels");
-    channelHoppingSequence = new int[numFrequencyChannels];
-    for (int i = 0; i < numFrequencyChannels; i++) {
-        channelHoppingSequence[i] = par("channelHoppingSequence", i);
-    }
+    channelHoppingDwell = max(1, (int)par("channelHoppingDwell"));
+    double hoppingBaseFrequency = par("hoppingBaseFrequency");       // MHz, carrier of channel 1
+    double hoppingChannelSpacing = par("hoppingChannelSpacing");     // MHz
+    cStringTokenizer hoppingTokenizer(par("channelHoppingSequence"));
+    vector<int> channelHoppingSequence = hoppingTokenizer.asIntVector();
+    hopFrequencies.clear();
+    for (int i = 0; i < numFrequencyChannels && i < (int)channelHoppingSequence.size(); i++)
+        hopFrequencies.push_back(hoppingBaseFrequency + (channelHoppingSequence[i] - 1) * hoppingChannelSpacing);
+    if (hopFrequencies.empty()) channelHopping = false;
+    hubHopState = -1;
+    lastBeaconHopState = -1;
+    beaconHopDwell = channelHoppingDwell;
+    currentCarrierFrequency = -1;
 
     enableSleepModes = par("enableSleepModes");
     sleepInterval = (double)par("sleepInterval") / 1000.0; // Convert milliseconds to seconds
 
     enableCoexistence = par("enableCoexistence");
+    // Beacon shifting, only used by hubs when another BAN is heard
+    beaconShiftOffset = par("beaconShiftOffset");       // in allocation slots
+    beaconShiftIndex = -1;
+    beaconShiftPhase = 0;
+    lastBeaconShiftIndex = -1;
+    lastBeaconShiftPhase = 0;
+
+    // The hub's superframe layout. EAP and CAP lengths are converted to allocation slots
+    if (isHub) rebuildHubSchedule();
+
+    // Radio energy accounting per macState. Powers are in mW, so energy is in mJ
+    radioTxPower = par("radioTxPower");
+    radioRxPower = par("radioRxPower");
+    radioSleepPower = par("radioSleepPower");
+    radioState = RX;
+    radioAccountingStart = getClock();
+    radioEnergyByMacState.clear();
+    radioOnTimeByMacState.clear();
+    /* Sleeping for a gap g costs two transitions of pTimeSleepToTX at (roughly) RX
+     * power plus sleep power for the rest, against RX power for all of g when idle
+     * listening. Since sleep power is negligible, sleeping pays off when g > 2*pTimeSleepToTX.
+     */
+    breakEvenSleepTime = 2 * pTimeSleepToTX;
+    radioTxBusyUntil = 0;
+    radioCommandsIssued = 0;
+    radioCommandsSuppressed = 0;
+    txCommandsCoalesced = 0;
+    declareOutput("Radio commands");
+    declareOutput("Data latency per UP, acked (ms)");
+    declareOutput("Data latency per UP, delivered at hub (ms)");
+    declareOutput("Data latency per UP, dropped (ms)");
+    declareOutput("Data latency per access mode (ms)");
+
+    // Per beacon period queue and slot utilization vectors
+    txBufferMeanVector.setName("TXBuffer depth (mean per beacon period)");
+    txBufferMaxVector.setName("TXBuffer depth (max per beacon period)");
+    mgmtBufferMaxVector.setName("MgmtBuffer depth (max per beacon period)");
+    pollTimersMaxVector.setName("hubPollTimers length (max per beacon period)");
+    slotsAllocatedVector.setName("Slots allocated per beacon period");
+    slotsUsedVector.setName("Slots carrying frames per beacon period");
+    // Sensors learn the beacon period length from the first beacon, and size it there
+    slotCarriedFrame.clear();
+    if (isHub) slotCarriedFrame.assign(beaconPeriodLength + 2, false);
+    declareOutput("Radio energy by MAC state (mJ)");
+    declareOutput("Radio on time by MAC state (s)");
+
+    // Beacon based clock drift estimation, worst case until enough beacons are seen
+    driftEstimationBeacons = par("driftEstimationBeacons");
+    driftConfidence = par("driftConfidence");
+    driftSamples.clear();
+    driftBeaconPeriod = 0;
+    driftEstimateVector.setName("Estimated clock drift (ppm)");
+    estimatedClockDrift = mClockAccuracy;
+
+    // Traffic adaptive wakeup interval for sensors
+    adaptiveWakeupInterval = par("adaptiveWakeupInterval");
+    maxScheduledAccessPeriod = par("maxScheduledAccessPeriod");
+    maxScheduledAccessLength = par("maxScheduledAccessLength");
+    wakeupAdaptationPeriod = par("wakeupAdaptationPeriod");
+    arrivalsSinceAdaptation = 0;
+    arrivalsPerBeaconPeriod = -1;
+    avgDataPacketBytes = 0;
+    lastAdaptationTime = -1;
+    beaconsSinceRenegotiation = 0;
+    requestedWakeupInterval = -1;
+
+    // Superframe plan, driven by the single SUPERFRAME_PLAN timer
+    superframePlan.clear();
+    superframePlanArmedAt = -1;
+    superframePlanBatch = false;
+
+    // Bounded, priority aware TXBuffer
+    macBufferSize = par("macBufferSize");
+    macBufferBytes = par("macBufferBytes");
+    upBufferSize = par("upBufferSize");
+    upBufferBytes = par("upBufferBytes");
+    string overflowPolicy = par("bufferOverflowPolicy").stringValue();
+    if (overflowPolicy == "dropLowestUP") bufferOverflowPolicy = BUFFER_DROP_LOWEST_UP;
+    else if (overflowPolicy == "dropOldest") bufferOverflowPolicy = BUFFER_DROP_OLDEST;
+    else if (overflowPolicy == "tailDrop") bufferOverflowPolicy = BUFFER_TAIL_DROP;
+    else throw cRuntimeError("Unknown bufferOverflowPolicy %s", overflowPolicy.c_str());
+    txBufferBytes = 0;
+    for (int up = 0; up < 8; up++) {
+        txBufferPacketsByUP[up] = 0;
+        txBufferBytesByUP[up] = 0;
+    }
+    declareOutput("Data pkt breakdown per UP");
+    nextDataSequenceNumber = 0;
+    lastDataSequenceNumber.clear();
+
+    // Hub downlink queues, one per connected NID
+    downlinkQueues.clear();
+    downlinkPostSlot.clear();
+    // Beacons the hub has sent, and the beacon period each node was last heard in
+    hubBeaconCount = 0;
+    nodeHeardInBeacon.clear();
+    // Scheduled downlink: slots per wakeup a sensor asks for, and the hub's downlink allocations
+    downlinkAccessLength = par("downlinkAccessLength");
+    downlinkAssignmentMap.clear();
+    scheduledRxAccessStart = UNCONNECTED;
+    scheduledRxAccessEnd = UNCONNECTED;
+
+    // Batched connection assignments and join statistics
+    batchConnectionAssignments = par("batchConnectionAssignments");
+    maxBeaconAssignments = par("maxBeaconAssignments");
+    assignmentWaitBeacons = par("assignmentWaitBeacons");
+    pendingAssignments.clear();
+    joinedNIDs.clear();
+    lastJoinTime = -1;
+    connectionRequestAcked = false;
+    beaconsSinceJoinRequest = 0;
+    joinedNodesVector.setName("Nodes joined");
+    declareOutput("Join");
+
+    // Load adaptive choice between naive and per-ACK polling
+    adaptivePolling = par("adaptivePolling");
+    naivePollingEnterLoad = par("naivePollingEnterLoad");
+    naivePollingExitLoad = par("naivePollingExitLoad");
+    if (naivePollingExitLoad > naivePollingEnterLoad) naivePollingExitLoad = naivePollingEnterLoad;
+    moreDataNIDs.clear();
+    pollingModeVector.setName("Polling scheme (1 = naive, 0 = per-ACK)");
+
+    // Poll grants of the current superframe
+    hubPollTimers.clear();
+    activePollGrant.NID = BROADCAST_NID;
+    activePollGrant.slotsGiven = 0;
+    activePollGrant.endSlot = 0;
+
+    // Hub ACK fast path: per NID ACK templates, built on first use, and the fixed ACK turnaround
+    ackTemplates[0].clear();
+    ackTemplates[1].clear();
+    ackTurnaround = TX_TIME(BASELINEBAN_HEADER_SIZE) + 2 * pTIFS;
+
+    // Management retry queue: rounds of maxPacketTries a management frame gets, over beacon periods
+    managementRetryRounds = max(1, (int)par("managementRetryRounds"));
+    managementRoundsLeft.clear();
+    parkedManagement.clear();
+
+    /* Hub tuning of the allocation slot length and beacon period. Changes are announced
+     * parameterChangeCountdown beacons ahead, so that sleeping sensors learn them in time.
+     */
+    adaptiveSlotLength = par("adaptiveSlotLength");
+    adaptiveBeaconPeriod = par("adaptiveBeaconPeriod");
+    slotAdaptationPeriod = max(1, (int)par("slotAdaptationPeriod"));
+    minAllocationSlotLength = par("minAllocationSlotLength");     // msec
+    maxAllocationSlotLength = par("maxAllocationSlotLength");     // msec
+    maxBeaconPeriodLength = min(255, (int)par("maxBeaconPeriodLength"));
+    configuredBeaconPeriod = beaconPeriodLength * allocationSlotLength;
+    beaconsSinceSlotAdaptation = 0;
+    frameAirtimeSum = 0;
+    frameAirtimeCount = 0;
+    nodeWakeupInterval.clear();
+    parameterChangeCountdown = 0;
+    pendingAllocationSlotLength = (int)round(allocationSlotLength * 1000);
+    pendingBeaconPeriodLength = beaconPeriodLength;
+    pendingBeaconPeriodTime = 0;
+    slotLengthVector.setName("Allocation slot length (ms)");
+    beaconPeriodVector.setName("Beacon period length (slots)");
+
+    // RAP length resized every superframe from RAP contention statistics
+    dynamicRAP = par("dynamicRAP");
+    minRAP1Length = max(1, (int)par("minRAP1Length"));
+    maxRAP1Length = par("maxRAP1Length");
+    rapExpandCollisionRatio = par("rapExpandCollisionRatio");
+    rapExpandBusyRatio = par("rapExpandBusyRatio");
+    rapShrinkBusyRatio = par("rapShrinkBusyRatio");
+    clearRAPStatistics();
+    rapLengthVector.setName("RAP1 length (slots)");
+
+    // Superframe phases, the hub sets them from its layout, sensors from every beacon
+    if (!isHub) {
+        EAP1Length = 0;
+        CAPStart = 0;
+    }
+
+    // Packet parked while a smaller one fills the end of an access period
+    deferredPacket = NULL;
+    deferredPacketTransmissions = 0;
+    deferredPacketCSFails = 0;
+
+    // Warm start from the state a previous run saved (see writeCheckpoint())
+    checkpointFile = par("checkpointFile").stringValue();
+    saveCheckpoint = par("saveCheckpoint") && !checkpointFile.empty();
+    if (par("restoreCheckpoint").boolValue() && !checkpointFile.empty() && readCheckpoint())
+        collectOutput("var stats", "warm start");
 
     // Existing code...
 }
@@ -54,51 +548,42 @@ void BaselineBANMac::fromNetworkLayer(cPacket *pkt, int dst) {
     BaselineMacPacket *BaselineBANDataPkt = new BaselineMacPacket("BaselineBAN data packet", MAC_LAYER_PACKET);
     encapsulatePacket(BaselineBANDataPkt, pkt);
 
+    // Stamp the enqueue time, end-to-end latency is measured from here
+    BaselineBANDataPkt->setTimestamp(simTime());
+    sampleQueues();
+
+    // Arrival statistics used by the adaptive wakeup interval
+    arrivalsSinceAdaptation++;
+    avgDataPacketBytes = (avgDataPacketBytes <= 0) ? BaselineBANDataPkt->getByteLength() :
+            0.9 * avgDataPacketBytes + 0.1 * BaselineBANDataPkt->getByteLength();
+
     // Determine the priority level and traffic category of the data packet
     int priorityLevel = BaselineBANDataPkt->getPriority(); // Assuming priority level is set in the BaselineMacPacket
     string trafficCategory = BaselineBANDataPkt->getTrafficCategory(); // Assuming traffic category is set in the BaselineMacPacket
 
-    // Check if the packet can be buffered based on its priority and traffic category
-    bool canBufferPacket = true; // Add logic to check if the buffer has space for the packet based on priority and category
+    // The hub keeps data for connected nodes in per NID downlink queues, delivered in posts
+    if (isHub && queueDownlink(BaselineBANDataPkt, dst)) return;
+    if (isHub) BaselineBANDataPkt->setNID(BROADCAST_NID);
+
+    // Check if the packet can be buffered based on its priority and the buffer caps
+    bool canBufferPacket = admitToTXBuffer(BaselineBANDataPkt);
     if (canBufferPacket) {
-        if (priorityLevel == 7) {
-            // High priority (P1 - Emergency) packet, transmit during EAP using TDMA
-            if (isHub) {
-                // Hub schedules the transmission slot for the node with UP7 in EAP
-                scheduleEAPTransmission(BaselineBANDataPkt, dst);
-            } else {
-                // Sensor nodes transmit their UP7 packets during their scheduled EAP slot
-                attemptTXDuringEAP(BaselineBANDataPkt);
-            }
-        } else if (priorityLevel >= 4 && priorityLevel <= 6) {
-            // Medium priority (P2 - Dependent) packet, transmit during RAP using CSMA/CA
-            if (isHub) {
-                // Hub schedules the RAP slot for nodes with UP4, UP5, and UP6
-                scheduleRAPTransmission(BaselineBANDataPkt, dst);
-            } else {
-                // Sensor nodes transmit their UP4, UP5, and UP6 packets during their scheduled RAP slot
-                attemptTXDuringRAP(BaselineBANDataPkt);
-            }
-        } else {
-            // Low priority (P3 - Independent) packet, transmit during CAP using CSMA/CA
-            if (isHub) {
-                // Hub schedules the CAP slot for nodes with UP0, UP1, UP2, and UP3
-                scheduleCAPTransmission(BaselineBANDataPkt, dst);
-            } else {
-                // Sensor nodes transmit their UP0, UP1, UP2, and UP3 packets during their scheduled CAP slot
-                attemptTXDuringCAP(BaselineBANDataPkt);
-            }
-        }
+        /* TXBuffer owns the packet now. attemptTX() draws it from there, and when it may
+         * go follows from the access period it is in (mayContend() for EAP1/RAP1/CAP).
+         */
+        attemptTX();
     } else {
-        trace() << "WARNING BaselineBAN MAC buffer overflow";
-        collectOutput("Data pkt breakdown", "Fail, buffer overflow");
+        trace() << "WARNING BaselineBAN MAC buffer overflow, UP" << priorityLevel;
+        collectDataOutcome(BaselineBANDataPkt, "Fail, buffer overflow");
+        recordLatency(BaselineBANDataPkt, LATENCY_DROPPED, currentAccessMode());
+        cancelAndDelete(BaselineBANDataPkt);
     }
 }
 
 
 void BaselineBANMac::attemptTxInRAP() {
-    // Check if the node is eligible to transmit in RAP based on priority level
-    if (priorityLevel >= 4 && priorityLevel <= 6) {
+    // Check if the packet may contend in the current phase (see mayContend())
+    if (mayContend(packetToBeSent)) {
         // Check if the channel is idle (carrier sensing)
         if (!isChannelBusy()) {
             // If the backoff counter is zero, initiate the backoff process
@@ -125,8 +610,8 @@ void BaselineBANMac::attemptTxInRAP() {
             setTimer(CARRIER_SENSING, waitTime);
         }
     } else {
-        // Node is not eligible to transmit in RAP, do not attempt transmission
-        trace() << "Node is not eligible to transmit in RAP. Priority Level: " << priorityLevel;
+        // Not this packet's phase, attemptContention() retries when its phase starts
+        trace() << "Packet of UP" << packetToBeSent->getPriority() << " may not contend in this phase";
     }
 }
 
@@ -530,27 +1015,61 @@ void BaselineBANMac::fromRadioLayer(cPacket *pkt, double rssi, double lqi) {
     BaselineMacPacket *BaselineBANPkt = dynamic_cast<BaselineMacPacket*>(pkt);
     if (BaselineBANPkt == NULL) return;
 
+    // A hub listening in its own superframe watches for beacons of neighbouring BANs
+    if (isHub && BaselineBANPkt->getFrameSubtype() == BEACON && BaselineBANPkt->getHID() != connectedHID) {
+        handleForeignBeacon(check_and_cast<BaselineBeaconPacket*>(BaselineBANPkt));
+        return;
+    }
+
     // Filter the incoming BaselineBAN packet
     if (!isPacketForMe(BaselineBANPkt)) return;
 
+    // The first frame heard from a connected NID confirms that its assignment was delivered
+    if (isHub && BaselineBANPkt->getFrameSubtype() != CONNECTION_REQUEST) confirmJoin(BaselineBANPkt->getNID());
+
+    // A frame decoded in RAP, for the RAP contention statistics
+    if (isHub && dynamicRAP && currentSlot <= RAP1Length) {
+        rapSlotHeard = true;
+        // A frame that started in an earlier slot was heard there too, that slot was no collision
+        int startSlot = (int)floor(SIMTIME_DBL(getClock() - TX_TIME(BaselineBANPkt->getByteLength()) - frameStartTime) / allocationSlotLength) + 1;
+        for (int slot = max(startSlot, 1); slot < currentSlot && slot < (int)rapSlotCollision.size(); slot++) {
+            if (!rapSlotCollision[slot]) continue;
+            rapSlotCollision[slot] = false;
+            rapCollisionSlots--;
+        }
+        rapFramesHeard++;
+        if (BaselineBANPkt->getFrameSubtype() == CONNECTION_REQUEST) rapJoinRequests++;
+    }
+
     /* Handle data packets */
     if (BaselineBANPkt->getFrameType() == DATA) {
-        toNetworkLayer(decapsulatePacket(BaselineBANPkt));
+        // A retransmission of a frame the hub already has (its ACK was lost) is acknowledged again, not passed up
+        bool duplicate = isHub && isDuplicateData(BaselineBANPkt);
+        if (isHub) collectDataOutcome(BaselineBANPkt, duplicate ? "Duplicate at hub" : "Received at hub");
+        if (isHub && !duplicate) recordLatency(BaselineBANPkt, LATENCY_DELIVERED, currentAccessMode());
+        if (isHub) {
+            // Only scheduled and polled slots count, they are what slotsAllocated is made of
+            int phase = scheduleManager.owner(currentSlot).phase;
+            if (phase == SLOT_PHASE_SCHEDULED || phase == SLOT_PHASE_POLL) markSlotUsed(currentSlot);
+            // Airtime of the frame and its ACK exchange, for the slot length controller
+            frameAirtimeSum += SIMTIME_DBL(TX_TIME(BaselineBANPkt->getByteLength()) + (BaselineBANPkt->getAckPolicy() == I_ACK_POLICY ? ackTurnaround : pTIFS));
+            frameAirtimeCount++;
+        }
+        // Downlink with moreData: the hub holds the following slot for us, stay awake for it
+        if (!isHub && macState == MAC_FREE_RX_ACCESS && BaselineBANPkt->getMoreData() > 0) extendPostedAccess();
+        // A node with nothing more to send gives back the rest of its polled slots
+        if (isHub && BaselineBANPkt->getMoreData() == 0) cancelPollGrants(BaselineBANPkt->getNID());
+        if (isHub) nodeHeardInBeacon[BaselineBANPkt->getNID()] = hubBeaconCount;
+        int postSlot = (isHub && !sendIAckPoll && BaselineBANPkt->getAckPolicy() == I_ACK_POLICY) ?
+                scheduleDownlinkPost(BaselineBANPkt->getNID()) : -1;
+        if (!duplicate) toNetworkLayer(decapsulatePacket(BaselineBANPkt));
         /* If this pkt requires a block ACK, we should send it,
          * by looking at what packet we have received (NOT IMPLEMENTED) */
         // NOT IMPLEMENTED
 
         // Handle future polls (I_ACK_POLL)
         if (BaselineBANPkt->getAckPolicy() == I_ACK_POLICY) {
-            BaselineMacPacket *ackPacket = new BaselineMacPacket("ACK packet", MAC_LAYER_PACKET);
-            setHeaderFields(ackPacket, N_ACK_POLICY, CONTROL, (sendIAckPoll ? I_ACK_POLL : I_ACK));
-            ackPacket->setNID(BaselineBANPkt->getNID());
-            ackPacket->setByteLength(BASELINEBAN_HEADER_SIZE);
-
-            // If we are unconnected, set a proper HID (the packet is for us since it was not filtered)
-            if (connectedHID == UNCONNECTED) {
-                ackPacket->setHID(BaselineBANPkt->getHID());
-            }
+            BaselineMacPacket *ackPacket = createAck(BaselineBANPkt, sendIAckPoll);
 
             // Set the appropriate fields if this is an I_ACK_POLL
             if (sendIAckPoll) {
@@ -559,37 +1078,43 @@ void BaselineBANMac::fromRadioLayer(cPacket *pkt, double rssi, double lqi) {
                 sendIAckPoll = false;
 
                 if (!naivePollingScheme) {
-                    // If this node was not given a future poll already, update the hubPollTimers and nextFuturePollSlot.
-                    // Also, if the hubPollTimers is empty, schedule the timer to send this first POLL
-                    if (hubPollTimers.empty() || hubPollTimers.back().NID != BaselineBANPkt->getNID()) {
-                        if (hubPollTimers.empty()) {
-                            setTimer(SEND_POLL, frameStartTime + (nextFuturePollSlot - 1) * allocationSlotLength - getClock());
-                        }
-
+                    // If this node was not given a future poll already, grant it the first free slot
+                    // (slots released by cancelled grants included) and re-arm SEND_POLL if needed
+                    int pollSlot = scheduleManager.findFreeRun(1, max(currentSlot + 1, nextFuturePollSlot), beaconPeriodLength + 1);
+                    if (hubPollTimers.grantOf(BaselineBANPkt->getNID()) == NULL && pollSlot > 0) {
                         TimerInfo t;
                         t.NID = BaselineBANPkt->getNID();
                         t.slotsGiven = 1;
-                        t.endSlot = nextFuturePollSlot;
+                        t.endSlot = pollSlot;
                         hubPollTimers.push(t);
-                        nextFuturePollSlot++;
+                        scheduleManager.assign(t.NID, SLOT_UPLINK, SLOT_PHASE_POLL, t.endSlot, t.endSlot + 1);
                         lastTxAccessSlot[t.NID].polled = t.endSlot;
+                        armPollTimer();
                     }
                 }
 
-                int futurePollSlot = (naivePollingScheme ? nextFuturePollSlot : hubPollTimers.back().endSlot);
+                const TimerInfo *grant = hubPollTimers.grantOf(BaselineBANPkt->getNID());
+                int futurePollSlot = (naivePollingScheme || grant == NULL) ? nextFuturePollSlot : grant->endSlot;
                 trace() << "Future POLL at slot " << futurePollSlot << " inserted in ACK packet";
                 ackPacket->setSequenceNumber(futurePollSlot);
             }
 
+            // Announce a post for pending downlink, the node wakes up to receive at postSlot
+            if (postSlot > 0) {
+                ackPacket->setFrameSubtype(I_ACK_POLL);
+                ackPacket->setMoreData(1);
+                ackPacket->setSequenceNumber(postSlot);
+                ackPacket->setFragmentNumber(0);
+                trace() << "Downlink post at slot " << postSlot << " inserted in ACK packet";
+            }
+
             trace() << "Transmitting ACK to/from NID:" << BaselineBANPkt->getNID();
-            toRadioLayer(ackPacket);
-            toRadioLayer(createRadioCommand(SET_STATE, TX));
-            isRadioSleeping = false;
+            transmitToRadio(ackPacket);
 
             // Any future attempts to TX should be done AFTER we are finished TXing the I-ACK.
             // Set the appropriate timer and variable.
-            // BASELINEBAN_HEADER_SIZE is the size of the ACK. 2*pTIFS is explained at sendPacket()
-            setTimer(START_ATTEMPT_TX, (TX_TIME(BASELINEBAN_HEADER_SIZE) + 2 * pTIFS));
+            // ackTurnaround is TX_TIME(BASELINEBAN_HEADER_SIZE) + 2*pTIFS. 2*pTIFS is explained at sendPacket()
+            setTimer(START_ATTEMPT_TX, ackTurnaround);
             futureAttemptToTX = true;
         }
     }
@@ -604,114 +1129,158 @@ void BaselineBANMac::fromRadioLayer(cPacket *pkt, double rssi, double lqi) {
     BaselineBeaconPacket * BaselineBANBeacon = check_and_cast<BaselineBeaconPacket*>(BaselineBANPkt);
     simtime_t beaconTxTime = TX_TIME(BaselineBANBeacon->getByteLength()) + pTIFS;
 
+    // Close the samples of the superframe that just ended
+    emitSuperframeSamples();
+
     // Store the time the frame starts. Needed for polls and posts, which only reference end allocation slot
     frameStartTime = getClock() - beaconTxTime;
 
+    // All superframe timers set below are compiled into the plan and armed once, at the end
+    beginSuperframePlan();
+
     // Get the allocation slot length, which is used in many calculations
+    double previousSlotLength = allocationSlotLength;
     allocationSlotLength = BaselineBANBeacon->getAllocationSlotLength() / 1000.0;
-    SInominal = (allocationSlotLength / 10.0 - pTIFS) / (2 * mClockAccuracy);
+    /* The hub changed the slot length (announced in earlier beacons) and/or the RAP
+     * length since the last beacon we heard. Our slots scale with the slot length and
+     * move with the end of RAP.
+     */
+    double slotFactor = previousSlotLength / allocationSlotLength;
+    int rapShift = BaselineBANBeacon->getRAP1Length() - (int)round(RAP1Length * slotFactor);
+    if (connectedHID != UNCONNECTED && (fabs(slotFactor - 1) > 1e-9 || rapShift != 0))
+        moveOwnSchedule(slotFactor, rapShift);
+    // A change still to come decides how long the next beacon periods are
+    parameterChangeCountdown = BaselineBANBeacon->getParameterChangeCountdown();
+    pendingBeaconPeriodTime = BaselineBANBeacon->getPendingBeaconPeriodLength() * BaselineBANBeacon->getPendingAllocationSlotLength() / 1000.0;
+    // Feed the drift estimator before deriving anything from the clock drift
+    // (a shifted beacon is taken back to its nominal time, the estimator needs a strictly periodic series)
+    recordBeaconArrival(frameStartTime - beaconShift(BaselineBANBeacon->getBeaconShiftingSequenceIndex(), BaselineBANBeacon->getBeaconShiftingSequencePhase()),
+            BaselineBANBeacon->getBeaconPeriodLength() * allocationSlotLength);
+    SInominal = (allocationSlotLength / 10.0 - pTIFS) / (2 * estimatedClockDrift);
 
     // A beacon is our synchronization event. Update relevant timer
     pastSyncIntervalNominal = false;
-    setTimer(SYNC_INTERVAL_TIMEOUT, SInominal);
+    planAction(SYNC_INTERVAL_TIMEOUT, SInominal);
 
     beaconPeriodLength = BaselineBANBeacon->getBeaconPeriodLength();
     RAP1Length = BaselineBANBeacon->getRAP1Length();
+    if ((int)slotCarriedFrame.size() != beaconPeriodLength + 2) slotCarriedFrame.assign(beaconPeriodLength + 2, false);
 
-    // Determine the user priority based on the node's characteristics
-    int userPriority = getUserPriority(); // Implement your own function to determine user priority (p1, p2, p3)
+    // Beacon shifting of the hub, needed to know where the next beacons will be
+    lastBeaconShiftIndex = BaselineBANBeacon->getBeaconShiftingSequenceIndex();
+    lastBeaconShiftPhase = BaselineBANBeacon->getBeaconShiftingSequencePhase();
 
-    // Check the user priority to handle different superframes
-    if (userPriority == 7) {
-        // User priority p1 (UP7) - High priority, EAP superframe
-        trace() << "State from " << macState << " to MAC_EAP";
-        macState = MAC_EAP;
-        endTime = getClock() + EAPLength * allocationSlotLength - beaconTxTime;
-    } else if (userPriority >= 4 && userPriority <= 6) {
-        // User priority p2 (UP4, UP5, UP6) - Medium priority, RAP superframe
-        trace() << "State from " << macState << " to MAC_RAP";
-        macState = MAC_RAP;
-        endTime = getClock() + RAP1Length * allocationSlotLength - beaconTxTime;
-    } else {
-        // User priority p3 (UP0, UP1, UP2, UP3) - Low priority, CAP superframe
-        trace() << "State from " << macState << " to MAC_CAP";
-        macState = MAC_CAP;
-        endTime = getClock() + CAP1Length * allocationSlotLength - beaconTxTime;
-    }
+    // Follow the hub's hopping pattern, a negative state means that the hub does not hop
+    lastBeaconHopState = (hopFrequencies.empty() ? -1 : BaselineBANBeacon->getChannelHoppingState());
+    if (lastBeaconHopState >= 0) beaconHopDwell = max(1, BaselineBANBeacon->getChannelHoppingDwell());
+
+    /* Superframe phases advertised by the hub: EAP1 is slots [1, EAP1Length], RAP1 runs
+     * up to RAP1Length and CAP from CAPStart (0: no CAP) to the end of the beacon period.
+     * EAP1 and RAP1 are one contention period, who may contend is decided per slot by mayContend().
+     */
+    EAP1Length = min(BaselineBANBeacon->getEAP1Length(), RAP1Length);
+    CAPStart = BaselineBANBeacon->getCAPStart();
+    trace() << "State from " << macState << " to MAC_RAP";
+    setMacState(MAC_RAP);
+    endTime = getClock() + RAP1Length * allocationSlotLength - beaconTxTime;
 
     collectOutput("Beacons received");
     trace() << "Beacon rx: reseting sync clock to " << SInominal << " secs";
     trace() << "           Slot= " << allocationSlotLength << " secs, beacon period= " << beaconPeriodLength << " slots";
-    trace() << "           RAP1= " << RAP1Length << " slots, RAP ends at time: " << endTime;
+    trace() << "           EAP1= " << EAP1Length << " slots, RAP1= " << RAP1Length << " slots, RAP ends at time: " << endTime;
 
-    /* Flush the Management packets buffer. Delete packetToBeSent if it is a management packet
-     * This is a design choice. It simplifies the flowcontrol and prevents rare cases where
-     * management packets are piled up. More complicated schemes chould be applied w.r.t.
-     * connection requests and connection assignments.
+    /* Management frames are not flushed at the beacon. They stay in MgmtBuffer, one per
+     * (subtype, destination) thanks to pushManagement(), and frames that ran out of
+     * tries in the last period get their next round now, within their retry budget.
      */
-    if (packetToBeSent != nullptr && packetToBeSent->getFrameType() != DATA) {
-        cancelAndDelete(packetToBeSent);
-        packetToBeSent = nullptr;
-    }
-
-    while (!MgmtBuffer.empty()) {
-        cancelAndDelete(MgmtBuffer.front());
-        MgmtBuffer.pop();
+    requeueParkedManagement();
+
+    // An assignment for us batched in the beacon
+    for (unsigned int i = 0; i < BaselineBANBeacon->getAssignmentsArraySize(); i++) {
+        const ConnectionAssignmentEntry &assignment = BaselineBANBeacon->getAssignments(i);
+        if (assignment.recipientAddress != SELF_MAC_ADDRESS) {
+            // An answer to another node's request, sent from our temporary NID
+            if (assignment.requesterNID == unconnectedNID) unconnectedNIDCollision();
+            continue;
+        }
+        // Once connected, only the answer to a renegotiation is news to us
+        if (connectedHID != UNCONNECTED && assignment.statusCode != MODIFIED &&
+            (requestedWakeupInterval < 0 || assignment.statusCode == ACCEPTED)) break;
+        trace() << "Connection assignment found in beacon";
+        applyConnectionAssignment(assignment);
+        break;
     }
 
     // Check if the node is connected to the hub
     if (connectedHID == UNCONNECTED) {
         // Go into a setup phase again after this beacon's RAP
-        setTimer(START_SETUP, RAP1Length * allocationSlotLength - beaconTxTime);
+        planAction(START_SETUP, RAP1Length * allocationSlotLength - beaconTxTime);
         trace() << "(unconnected): Go back to setup mode when RAP ends";
 
         // We will try to connect to this BAN if our scheduled access length is NOT set to unconnected (-1)
-        if (scheduledAccessLength >= 0) {
+        // A request the hub acknowledged is answered in a later beacon, do not repeat it meanwhile
+        if (connectionRequestAcked && ++beaconsSinceJoinRequest <= assignmentWaitBeacons) {
+            trace() << "(unconnected): waiting for the batched assignment";
+        } else if (scheduledAccessLength >= 0) {
+            connectionRequestAcked = false;
             // We are unconnected, and we need to connect to obtain scheduled access
-            // Create and send a connection request
-            BaselineConnectionRequestPacket *connectionRequest = new BaselineConnectionRequestPacket("BaselineBAN connection request packet", MAC_LAYER_PACKET);
-
-            // This block takes care of general header fields
-            setHeaderFields(connectionRequest, I_ACK_POLICY, MANAGEMENT, CONNECTION_REQUEST);
-            // While setHeaderFields should take care of the HID field, we are currently unconnected.
-            // We want to keep this state, yet send the request to the right hub.
-            connectionRequest->setHID(BaselineBANBeacon->getHID());
-
-            // This block takes care of connection request specific fields
-            connectionRequest->setRecipientAddress(BaselineBANBeacon->getSenderAddress());
-            connectionRequest->setSenderAddress(SELF_MAC_ADDRESS);
-            // In this implementation, our schedule always starts from the next beacon
-            connectionRequest->setNextWakeup(BaselineBANBeacon->getSequenceNumber() + 1);
-            connectionRequest->setWakeupInterval(scheduledAccessPeriod);
-            // Uplink request is simplified in this implementation to only ask for a number of slots needed
-            connectionRequest->setUplinkRequest(scheduledAccessLength);
-            connectionRequest->setByteLength(BASELINEBAN_CONNECTION_REQUEST_SIZE);
-
             // Management packets go in their own buffer, and handled by attemptTX() with priority
-            MgmtBuffer.push(connectionRequest);
-            trace() << "(unconnected): Created connection request";
+            // A request to this hub still pending is brought up to date instead of created anew
+            if (refreshConnectionRequest(BaselineBANBeacon)) {
+                trace() << "(unconnected): Connection request still pending, refreshed";
+            } else {
+                pushManagement(createConnectionRequest(BaselineBANBeacon, scheduledAccessPeriod, scheduledAccessLength, downlinkAccessLength));
+                trace() << "(unconnected): Created connection request";
+            }
+            // Joining nodes spread their requests over RAP, each starting at its own slot
+            if (hashedJoin) {
+                simtime_t offset = (joinHash(SELF_MAC_ADDRESS, 0) % max(RAP1Length, 1)) * allocationSlotLength - beaconTxTime;
+                if (offset > 0) {
+                    setTimer(START_ATTEMPT_TX, offset);
+                    futureAttemptToTX = true;
+                    trace() << "(unconnected): connection request staggered by " << offset << " secs";
+                }
+            }
         }
     } else {
-        // Schedule a timer to wake up for the next beacon (it might be m periods away)
-        setTimer(WAKEUP_FOR_BEACON, beaconPeriodLength * scheduledAccessPeriod * allocationSlotLength - beaconTxTime - GUARD_TIME);
+        // In adaptive mode, renegotiate the wakeup interval and uplink slots with the hub if needed
+        if (adaptiveWakeupInterval) adaptWakeupInterval(BaselineBANBeacon);
 
-        // If we have a schedule that does not start immediately after RAP, or our schedule
-        // is not assigned yet, then go to sleep after RAP.
-        if ((scheduledTxAccessStart == UNCONNECTED && RAP1Length < beaconPeriodLength)
-                || (scheduledTxAccessStart - 1 > RAP1Length)) {
-            setTimer(START_SLEEPING, RAP1Length * allocationSlotLength - beaconTxTime);
+        // Schedule a timer to wake up for the next beacon (it might be m periods away)
+        simtime_t sleepLength = timeForBeaconPeriods(scheduledAccessPeriod) - beaconTxTime
+                + beaconShiftDelta(lastBeaconShiftIndex, lastBeaconShiftPhase, scheduledAccessPeriod);
+        planAction(WAKEUP_FOR_BEACON, sleepLength - beaconWakeupLead(sleepLength));
+
+        // If we have a schedule (TX or RX) that does not start immediately after RAP, or
+        // our schedule is not assigned yet, then go to sleep after RAP.
+        int firstAccessStart = scheduledTxAccessStart;
+        if (scheduledRxAccessEnd > scheduledRxAccessStart &&
+                (firstAccessStart == UNCONNECTED || scheduledRxAccessStart < firstAccessStart))
+            firstAccessStart = scheduledRxAccessStart;
+        if ((firstAccessStart == UNCONNECTED && RAP1Length < beaconPeriodLength)
+                || (firstAccessStart - 1 > RAP1Length)) {
+            planAction(START_SLEEPING, RAP1Length * allocationSlotLength - beaconTxTime);
             trace() << "--- Start sleeping in: " << RAP1Length * allocationSlotLength - beaconTxTime << " secs";
         }
 
         // Schedule the timer to go in scheduled TX access, IF we have a valid schedule
         if (scheduledTxAccessEnd > scheduledTxAccessStart) {
-            setTimer(START_SCHEDULED_TX_ACCESS, (scheduledTxAccessStart - 1) * allocationSlotLength - beaconTxTime + GUARD_TX_TIME);
+            planAction(START_SCHEDULED_TX_ACCESS, (scheduledTxAccessStart - 1) * allocationSlotLength - beaconTxTime + GUARD_TX_TIME);
             trace() << "--- Start scheduled TX access in: " << (scheduledTxAccessStart - 1) * allocationSlotLength - beaconTxTime + GUARD_TX_TIME << " secs";
         }
 
-        // We should also handle the case when we have a scheduled RX access. This is not implemented yet.
+        // Wake up to receive in our scheduled RX access, a guard time early since the hub transmits at the slot start
+        if (scheduledRxAccessEnd > scheduledRxAccessStart) {
+            planAction(START_SCHEDULED_RX_ACCESS, (scheduledRxAccessStart - 1) * allocationSlotLength - beaconTxTime - GUARD_TIME);
+            trace() << "--- Start scheduled RX access in: " << (scheduledRxAccessStart - 1) * allocationSlotLength - beaconTxTime - GUARD_TIME << " secs";
+        }
+
+        // Contend in CAP if there is anything left to send by then
+        if (CAPStart > RAP1Length && CAPStart <= beaconPeriodLength)
+            planAction(START_CAP, (CAPStart - 1) * allocationSlotLength - beaconTxTime);
     }
 
+    commitSuperframePlan();
     attemptTX();
     break;
 }
@@ -723,6 +1292,16 @@ void BaselineBANMac::fromRadioLayer(cPacket *pkt, double rssi, double lqi) {
         }
 
         case I_ACK: {
+            // The I-ACK of a connection request names the requester's address, one for another node is not ours
+            if (packetToBeSent != NULL && packetToBeSent->getFrameSubtype() == CONNECTION_REQUEST &&
+                    BaselineBANPkt->getRecipientAddress() != SELF_MAC_ADDRESS) {
+                if (connectedHID == UNCONNECTED) {
+                    unconnectedNIDCollision();
+                    // Our request is still unanswered, the ACK timeout retries it with the new NID
+                    packetToBeSent->setNID(unconnectedNID);
+                }
+                break;
+            }
             waitingForACK = false;
             cancelTimer(ACK_TIMEOUT);
 
@@ -731,28 +1310,20 @@ void BaselineBANMac::fromRadioLayer(cPacket *pkt, double rssi, double lqi) {
                 break;
             }
 
-            // Collect statistics
-            int priority = getPacketPriority(packetToBeSent);
-            if (currentPacketTransmissions == 1) {
-                if (priority == PRIORITY_P1)
-                    collectOutput("Data pkt breakdown (P1)", "Success, 1st try");
-                else if (priority == PRIORITY_P2)
-                    collectOutput("Data pkt breakdown (P2)", "Success, 1st try");
-                else if (priority == PRIORITY_P3)
-                    collectOutput("Data pkt breakdown (P3)", "Success, 1st try");
-                else
-                    collectOutput("Mgmt & Ctrl pkt breakdown", "Success, 1st try");
-            } else {
-                if (priority == PRIORITY_P1)
-                    collectOutput("Data pkt breakdown (P1)", "Success, 2 or more tries");
-                else if (priority == PRIORITY_P2)
-                    collectOutput("Data pkt breakdown (P2)", "Success, 2 or more tries");
-                else if (priority == PRIORITY_P3)
-                    collectOutput("Data pkt breakdown (P3)", "Success, 2 or more tries");
-                else
-                    collectOutput("Mgmt & Ctrl pkt breakdown", "Success, 2 or more tries");
+            // The hub got our connection request
+            if (packetToBeSent->getFrameSubtype() == CONNECTION_REQUEST) {
+                connectionRequestAcked = true;
+                beaconsSinceJoinRequest = 0;
             }
 
+            // Collect statistics
+            const char *outcome = (currentPacketTransmissions == 1) ? "Success, 1st try" : "Success, 2 or more tries";
+            if (packetToBeSent->getFrameType() == DATA) {
+                recordLatency(packetToBeSent, LATENCY_ACKED, currentAccessMode());
+                collectDataOutcome(packetToBeSent, outcome);
+            } else collectOutput("Mgmt & Ctrl pkt breakdown", outcome);
+
+            managementRoundsLeft.erase(packetToBeSent);
             cancelAndDelete(packetToBeSent);
             packetToBeSent = NULL;
             currentPacketTransmissions = 0;
@@ -779,6 +1350,8 @@ case B_ACK: {
 
     // Clean up the packetToBeSent and related variables
     if (packetToBeSent != NULL) {
+        if (packetToBeSent->getFrameType() == DATA) recordLatency(packetToBeSent, LATENCY_ACKED, currentAccessMode());
+        managementRoundsLeft.erase(packetToBeSent);
         cancelAndDelete(packetToBeSent);
         packetToBeSent = NULL;
     }
@@ -788,175 +1361,1919 @@ case B_ACK: {
 
     // TODO: Analyze the bitmap and see if some of the LACK packets need to be retransmitted
 
-    // Attempt transmission of new packets
-    attemptTX();
-    break;
+    // Attempt transmission of new packets
+    attemptTX();
+    break;
+}
+
+case CONNECTION_ASSIGNMENT: {
+    BaselineConnectionAssignmentPacket *connAssignment = check_and_cast<BaselineConnectionAssignmentPacket*>(BaselineBANPkt);
+    if (connAssignment->getRecipientAddress() != SELF_MAC_ADDRESS) {
+        // Another unconnected node uses our temporary NID, the assignment is not ours
+        if (connAssignment->getRequesterNID() == unconnectedNID) unconnectedNIDCollision();
+        break;
+    }
+    applyConnectionAssignment(assignmentEntryOf(connAssignment));
+    break;
+}
+
+case DISCONNECTION: {
+    // Handle disconnection
+    connectedHID = UNCONNECTED;
+    connectedNID = UNCONNECTED;
+    // TODO: Handle any additional tasks or cleanups required upon disconnection
+    break;
+}
+
+case CONNECTION_REQUEST: {
+    BaselineConnectionRequestPacket *connRequest = check_and_cast<BaselineConnectionRequestPacket*>(BaselineBANPkt);
+
+    // Create the connection assignment packet
+    BaselineConnectionAssignmentPacket *connAssignment = new BaselineConnectionAssignmentPacket("BaselineBAN connection assignment", MAC_LAYER_PACKET);
+    setHeaderFields(connAssignment, I_ACK_POLICY, MANAGEMENT, CONNECTION_ASSIGNMENT);
+
+    // Get the full ID of the requesting node
+    int fullAddress = connRequest->getSenderAddress();
+    // Unconnected NIDs are not unique, the address lets the node check the assignment is its own
+    connAssignment->setRecipientAddress(fullAddress);
+    connAssignment->setRequesterNID(connRequest->getNID());
+
+    /* Acknowledge the request. The I-ACK names the requester's address (recipientAddress,
+     * as on connection assignments) so that nodes sharing a temporary NID can tell
+     * whose request the hub got.
+     */
+    if (connRequest->getAckPolicy() == I_ACK_POLICY) {
+        BaselineMacPacket *ackPacket = createAck(connRequest, false);
+        ackPacket->setRecipientAddress(fullAddress);
+        trace() << "Transmitting ACK to/from NID:" << connRequest->getNID();
+        transmitToRadio(ackPacket);
+        setTimer(START_ATTEMPT_TX, ackTurnaround);
+        futureAttemptToTX = true;
+    }
+
+    // Check if the request is on an already active assignment
+    map<int, slotAssign_t>::iterator iter = slotAssignmentMap.find(fullAddress);
+    // The wakeup interval the node gets, the one it asked for unless the grant has to be smaller
+    int grantedInterval = max(1, connRequest->getWakeupInterval());
+    bool renegotiation = iter != slotAssignmentMap.end() &&
+            (connRequest->getUplinkRequest() != iter->second.endSlot - iter->second.startSlot ||
+             (nodeWakeupInterval.count(fullAddress) && nodeWakeupInterval[fullAddress] != grantedInterval));
+    if (renegotiation) {
+        /* A connected node renegotiates its wakeup interval and uplink allocation. Its old
+         * run is given back first, so the new one can grow in place. The requested slots
+         * carry grantedInterval beacon periods of traffic: if they do not fit, a shorter
+         * run is granted with a proportionally shorter interval. If not even one beacon
+         * period of traffic fits, the old allocation is restored and the request rejected.
+         */
+        int requested = connRequest->getUplinkRequest();
+        int oldStart = iter->second.startSlot;
+        int oldLength = iter->second.endSlot - oldStart;
+        int oldInterval = nodeWakeupInterval.count(fullAddress) ? nodeWakeupInterval[fullAddress] : 1;
+        scheduleManager.release(oldStart, iter->second.endSlot);
+
+        int granted = requested;
+        int newStart = (requested <= oldLength) ? oldStart : -1;
+        for (; newStart < 0 && granted > 0; granted--) {
+            newStart = scheduleManager.findFreeRun(granted, RAP1Length + 1, scheduleManager.capStart());
+            if (newStart >= 0) break;
+        }
+        if (newStart >= 0 && granted < requested) grantedInterval = grantedInterval * granted / requested;
+
+        if (newStart < 0 || grantedInterval < 1) {
+            scheduleManager.assign(iter->second.NID, SLOT_UPLINK, SLOT_PHASE_SCHEDULED, oldStart, oldStart + oldLength);
+            grantedInterval = oldInterval;
+            connAssignment->setStatusCode(REJ_NO_RESOURCES);
+            trace() << "Connection of NID " << iter->second.NID << " not modified, no run of " << requested << " slots free";
+        } else {
+            iter->second.startSlot = newStart;
+            iter->second.endSlot = newStart + granted;
+            scheduleManager.assign(iter->second.NID, SLOT_UPLINK, SLOT_PHASE_SCHEDULED, iter->second.startSlot, iter->second.endSlot);
+            if (iter->second.endSlot > currentFirstFreeSlot) currentFirstFreeSlot = iter->second.endSlot;
+            lastTxAccessSlot[iter->second.NID].scheduled = iter->second.endSlot - 1;
+            assignDownlink(connAssignment, fullAddress, iter->second.NID, connRequest->getDownlinkRequest());
+            connAssignment->setStatusCode(MODIFIED);
+            trace() << "Connection of NID " << iter->second.NID << " modified: " << oldLength << " -> " << granted
+                    << " slots, wakeup interval " << oldInterval << " -> " << grantedInterval;
+        }
+        connAssignment->setAssignedNID(iter->second.NID);
+        connAssignment->setUplinkRequestStart(iter->second.startSlot);
+        connAssignment->setUplinkRequestEnd(iter->second.endSlot);
+    } else if (iter != slotAssignmentMap.end()) {
+        // The request has been processed *successfully* before, assign old resources
+        connAssignment->setStatusCode(ACCEPTED);
+        connAssignment->setAssignedNID(iter->second.NID);
+        connAssignment->setUplinkRequestStart(iter->second.startSlot);
+        connAssignment->setUplinkRequestEnd(iter->second.endSlot);
+        assignDownlink(connAssignment, fullAddress, iter->second.NID, connRequest->getDownlinkRequest());
+        trace() << "Connection request seen before! Assigning stored NID and resources...";
+        trace() << "Connection request from NID " << connRequest->getNID() << " (full addr: " << fullAddress << ") Assigning connected NID " << iter->second.NID;
+    } else {
+        // The request has not been processed before, try to assign new resources
+        if (connRequest->getUplinkRequest() + connRequest->getDownlinkRequest() > scheduleManager.capStart() - currentFirstFreeSlot) {
+            connAssignment->setStatusCode(REJ_NO_RESOURCES);
+            // Can not accommodate the request, no available resources
+        } else if (currentFreeConnectedNID > 239) {
+            connAssignment->setStatusCode(REJ_NO_NID);
+            // No available NIDs for new connections
+        } else {
+            // Update the slotAssignmentMap with the new assignment
+            slotAssign_t newAssignment;
+            newAssignment.NID = currentFreeConnectedNID;
+            newAssignment.startSlot = currentFirstFreeSlot;
+            newAssignment.endSlot = currentFirstFreeSlot + connRequest->getUplinkRequest();
+            slotAssignmentMap[fullAddress] = newAssignment;
+            scheduleManager.assign(newAssignment.NID, SLOT_UPLINK, SLOT_PHASE_SCHEDULED, newAssignment.startSlot, newAssignment.endSlot);
+            // Sequence numbers seen from an earlier holder of this NID say nothing about the new one
+            lastDataSequenceNumber.erase(newAssignment.NID);
+
+            // Construct the rest of the connection assignment packet
+            connAssignment->setStatusCode(ACCEPTED);
+            connAssignment->setAssignedNID(newAssignment.NID);
+            connAssignment->setUplinkRequestStart(newAssignment.startSlot);
+            connAssignment->setUplinkRequestEnd(newAssignment.endSlot);
+            trace() << "Connection request from NID " << connRequest->getNID() << " (full addr: " << fullAddress << ") Assigning connected NID " << newAssignment.NID;
+
+            // Update hub's lastTxAccessSlot and currentFreeConnectedNID
+            lastTxAccessSlot[currentFreeConnectedNID].scheduled = newAssignment.endSlot - 1;
+            currentFirstFreeSlot += connRequest->getUplinkRequest();
+            currentFreeConnectedNID++;
+            // Downlink slots follow the uplink ones
+            assignDownlink(connAssignment, fullAddress, newAssignment.NID, connRequest->getDownlinkRequest());
+        }
+    }
+
+    // Wakeup interval of connected nodes, a change of slot length or period is announced for the longest one
+    connAssignment->setWakeupInterval(grantedInterval);
+    if (slotAssignmentMap.count(fullAddress)) {
+        nodeWakeupInterval[fullAddress] = grantedInterval;
+        // The node wakes up every wakeup interval counting from this beacon period
+        nodeHeardInBeacon[slotAssignmentMap[fullAddress].NID] = hubBeaconCount;
+    }
+
+    if (batchConnectionAssignments) {
+        // The assignment goes out with the next beacons until the node is heard in its slots
+        queueBeaconAssignment(connAssignment, fullAddress);
+        cancelAndDelete(connAssignment);
+        break;
+    }
+    // Push the connection assignment packet to the Management packets buffer
+    pushManagement(connAssignment);
+
+    // Transmission will be attempted after we are done sending the I-ACK
+    trace() << "Connection assignment created, wait for " << (TX_TIME(BASELINEBAN_HEADER_SIZE) + 2 * pTIFS) << " to attemptTX";
+    break;
+}
+
+case T_POLL:
+    // Just read the time values from the payload, update relevant variables, and roll over to handle the POLL part (no break)
+case POLL: {
+    handlePoll(BaselineBANPkt);
+    break;
+}
+
+case ASSOCIATION:
+case DISASSOCIATION:
+case PTK:
+case GTK: {
+    trace() << "WARNING: unimplemented packet subtype in [" << BaselineBANPkt->getName() << "]";
+    // Handle unimplemented packet subtype according to your requirements
+    break;
+}
+
+
+
+}
+
+
+/* The specific finish function for BaselineBANMAC does needed cleanup when simulation ends
+ */
+void BaselineBANMac::finishSpecific(){
+	if (saveCheckpoint) writeCheckpoint();
+	if (packetToBeSent != NULL) cancelAndDelete(packetToBeSent);
+	if (deferredPacket != NULL) cancelAndDelete(deferredPacket);
+	accountRadioEnergy();
+	for (map<int, double>::iterator iter = radioEnergyByMacState.begin(); iter != radioEnergyByMacState.end(); iter++)
+		collectOutput("Radio energy by MAC state (mJ)", macStateName(iter->first), iter->second);
+	for (map<int, double>::iterator iter = radioOnTimeByMacState.begin(); iter != radioOnTimeByMacState.end(); iter++)
+		collectOutput("Radio on time by MAC state (s)", macStateName(iter->first), iter->second);
+	for (int kind = LATENCY_ACKED; kind <= LATENCY_DROPPED; kind++) {
+		string output = string("Data latency per UP, ") + latencyKindNames[kind] + " (ms)";
+		for (int up = 0; up < 8; up++)
+			collectLatencyOutput(output.c_str(), "UP" + to_string(up), latencyByUP[kind][up]);
+	}
+	for (int mode = ACCESS_RAP; mode <= ACCESS_POSTED; mode++)
+		collectLatencyOutput("Data latency per access mode (ms)", accessModeNames[mode], latencyByAccessMode[mode]);
+	if (isHub && lastJoinTime >= 0) {
+		collectOutput("Join", "nodes joined", joinedNIDs.size());
+		collectOutput("Join", "time to all connected (s)", SIMTIME_DBL(lastJoinTime));
+	}
+	collectOutput("Radio commands", "issued", radioCommandsIssued);
+	collectOutput("Radio commands", "suppressed", radioCommandsSuppressed);
+	collectOutput("Radio commands", "coalesced TX", txCommandsCoalesced);
+	while(!MgmtBuffer.empty()) {
+		cancelAndDelete(MgmtBuffer.front());
+		MgmtBuffer.pop();
+    }
+	for (unsigned int i = 0; i < parkedManagement.size(); i++) cancelAndDelete(parkedManagement[i]);
+	for (int poll = 0; poll < 2; poll++) {
+		for (unsigned int i = 0; i < ackTemplates[poll].size(); i++) delete ackTemplates[poll][i];
+		ackTemplates[poll].clear();
+	}
+	parkedManagement.clear();
+	for (map<int, queue<BaselineMacPacket*> >::iterator iter = downlinkQueues.begin(); iter != downlinkQueues.end(); iter++) {
+		while (!iter->second.empty()) {
+			cancelAndDelete(iter->second.front());
+			iter->second.pop();
+		}
+	}
+    if (isHub) {delete[] reqToSendMoreData; delete[] lastTxAccessSlot;}
+}
+
+bool BaselineBANMac::isPacketForMe(BaselineMacPacket *pkt) {
+    int pktUP = pkt->getUserPriority(); // Assuming you have a method to retrieve the User Priority from the packet
+    int pktNID = pkt->getNID(); // Assuming you have a method to retrieve the Node ID from the packet
+
+    // Check if the packet is addressed to the hub (User Priority 7)
+    if (pktUP == UP7) {
+        if (isHub) return true; // The hub can receive packets with UP7
+        return false; // Sensors cannot receive UP7 packets
+    }
+
+    // Check if the packet is addressed to the sensors (User Priority 6, 5, 4, 3, 2, 1, or 0)
+    if (pktUP >= UP0 && pktUP <= UP6) {
+        // Check if the packet is a broadcast packet
+        if (pktNID == BROADCAST_NID) {
+            if (isHub) return true; // The hub can receive broadcast packets
+            return false; // Sensors cannot receive broadcast packets
+        }
+
+        // Check if the packet is addressed to the hub
+        if (pktNID == connectedNID) {
+            if (isHub) return true; // The hub can receive packets addressed to itself
+            return false; // Sensors cannot receive packets addressed to the hub
+        }
+
+        // Check if the packet is addressed to any of the sensors (single-hop communication)
+        if (!isHub && pktNID >= 1 && pktNID <= 5) {
+            return true;
+        }
+    }
+
+    // For all other cases, the packet is not for this node
+    return false;
+}
+
+
+/* MAC state checkpoints, for warm starts. With saveCheckpoint a node writes its
+ * steady state to <checkpointFile>.<config>.<run>.<address> when the simulation
+ * ends, and with restoreCheckpoint it reads it back at startup, so a sweep can
+ * start from a network that is already connected instead of going through setup
+ * and the connection request/assignment exchanges again. The config name and run
+ * number keep the runs of a sweep from overwriting each other's files, so the warm
+ * run has to use the same config and run number as the run that saved the state. The file is a compact binary
+ * dump of 32 bit integers in host byte order (a warm start file, not an exchange
+ * format). Saved are:
+ *  - sensors: HID/NID, scheduled TX and RX slots, wakeup interval and uplink length,
+ *    CW state and the superframe geometry the slots refer to,
+ *  - hubs: superframe geometry, first free slot and NID, polling scheme, CW state,
+ *    the uplink and downlink assignment maps, the wakeup intervals and joined NIDs,
+ *    and the scheduled slot of every NID.
+ * Transient state (buffers, polls, posts, more data requests, pending assignments)
+ * is not saved.
+ */
+static const int CHECKPOINT_MAGIC = 0x42414E43;      // "BANC"
+static const int CHECKPOINT_VERSION = 2;
+
+static void writeCheckpointInt(ofstream &out, int value) {
+    int32_t v = value;
+    out.write((const char*)&v, sizeof(v));
+}
+
+static int readCheckpointInt(ifstream &in) {
+    int32_t v = 0;
+    in.read((char*)&v, sizeof(v));
+    return v;
+}
+
+static void writeCheckpointMap(ofstream &out, const map<int, slotAssign_t> &assignments) {
+    writeCheckpointInt(out, assignments.size());
+    for (map<int, slotAssign_t>::const_iterator iter = assignments.begin(); iter != assignments.end(); iter++) {
+        writeCheckpointInt(out, iter->first);
+        writeCheckpointInt(out, iter->second.NID);
+        writeCheckpointInt(out, iter->second.startSlot);
+        writeCheckpointInt(out, iter->second.endSlot);
+    }
+}
+
+static void readCheckpointMap(ifstream &in, map<int, slotAssign_t> &assignments) {
+    assignments.clear();
+    for (int i = readCheckpointInt(in); i > 0 && in; i--) {
+        int address = readCheckpointInt(in);
+        slotAssign_t assignment;
+        assignment.NID = readCheckpointInt(in);
+        assignment.startSlot = readCheckpointInt(in);
+        assignment.endSlot = readCheckpointInt(in);
+        assignments[address] = assignment;
+    }
+}
+
+string BaselineBANMac::checkpointPath() {
+    cConfigurationEx *config = ev.getConfigEx();
+    return checkpointFile + "." + config->getActiveConfigName() + "." +
+            to_string(config->getActiveRunNumber()) + "." + to_string(SELF_MAC_ADDRESS);
+}
+
+void BaselineBANMac::writeCheckpoint() {
+    ofstream out(checkpointPath().c_str(), ios::out | ios::binary | ios::trunc);
+    if (!out) throw cRuntimeError("Cannot write MAC checkpoint %s", checkpointPath().c_str());
+
+    writeCheckpointInt(out, CHECKPOINT_MAGIC);
+    writeCheckpointInt(out, CHECKPOINT_VERSION);
+    writeCheckpointInt(out, isHub ? 1 : 0);
+    writeCheckpointInt(out, connectedHID);
+    writeCheckpointInt(out, (int)round(allocationSlotLength * 1000));
+    writeCheckpointInt(out, beaconPeriodLength);
+    writeCheckpointInt(out, RAP1Length);
+    writeCheckpointInt(out, CW);
+    writeCheckpointInt(out, CWdouble ? 1 : 0);
+
+    if (isHub) {
+        writeCheckpointInt(out, currentFreeConnectedNID);
+        writeCheckpointInt(out, currentFirstFreeSlot);
+        writeCheckpointInt(out, naivePollingScheme ? 1 : 0);
+        writeCheckpointMap(out, slotAssignmentMap);
+        writeCheckpointMap(out, downlinkAssignmentMap);
+        writeCheckpointInt(out, nodeWakeupInterval.size());
+        for (map<int, int>::iterator iter = nodeWakeupInterval.begin(); iter != nodeWakeupInterval.end(); iter++) {
+            writeCheckpointInt(out, iter->first);
+            writeCheckpointInt(out, iter->second);
+        }
+        writeCheckpointInt(out, joinedNIDs.size());
+        for (set<int>::iterator iter = joinedNIDs.begin(); iter != joinedNIDs.end(); iter++)
+            writeCheckpointInt(out, *iter);
+        int used = 0;
+        for (int nid = 0; nid < HUB_NID_TABLE_SIZE; nid++)
+            if (lastTxAccessSlot[nid].scheduled != 0) used++;
+        writeCheckpointInt(out, used);
+        for (int nid = 0; nid < HUB_NID_TABLE_SIZE; nid++) {
+            if (lastTxAccessSlot[nid].scheduled == 0) continue;
+            writeCheckpointInt(out, nid);
+            writeCheckpointInt(out, lastTxAccessSlot[nid].scheduled);
+        }
+    } else {
+        writeCheckpointInt(out, connectedNID);
+        writeCheckpointInt(out, unconnectedNID);
+        writeCheckpointInt(out, scheduledTxAccessStart);
+        writeCheckpointInt(out, scheduledTxAccessEnd);
+        writeCheckpointInt(out, scheduledRxAccessStart);
+        writeCheckpointInt(out, scheduledRxAccessEnd);
+        writeCheckpointInt(out, scheduledAccessPeriod);
+        writeCheckpointInt(out, scheduledAccessLength);
+    }
+    trace() << "MAC checkpoint written to " << checkpointPath();
+}
+
+/* Restore the state written by writeCheckpoint(). A missing file means a cold
+ * start (the run that writes it), a file of the wrong version or role is an error.
+ * So is a hub file whose superframe geometry differs from this run's parameters:
+ * the saved slots only make sense in the geometry they were assigned in. A length
+ * the hub adapts at run time (adaptiveSlotLength, adaptiveBeaconPeriod, dynamicRAP)
+ * is part of its state instead, and is restored as saved.
+ */
+bool BaselineBANMac::readCheckpoint() {
+    ifstream in(checkpointPath().c_str(), ios::in | ios::binary);
+    if (!in) {
+        trace() << "No MAC checkpoint " << checkpointPath() << ", cold start";
+        return false;
+    }
+    if (readCheckpointInt(in) != CHECKPOINT_MAGIC || readCheckpointInt(in) != CHECKPOINT_VERSION)
+        throw cRuntimeError("%s is not a MAC checkpoint of this version", checkpointPath().c_str());
+    if (readCheckpointInt(in) != (isHub ? 1 : 0))
+        throw cRuntimeError("MAC checkpoint %s was written by a %s", checkpointPath().c_str(), isHub ? "sensor" : "hub");
+
+    connectedHID = readCheckpointInt(in);
+    int savedAllocationSlotLength = readCheckpointInt(in);
+    int savedBeaconPeriodLength = readCheckpointInt(in);
+    int savedRAP1Length = readCheckpointInt(in);
+    if (isHub && ((!adaptiveSlotLength && savedAllocationSlotLength != (int)round(allocationSlotLength * 1000)) ||
+            (!adaptiveBeaconPeriod && savedBeaconPeriodLength != beaconPeriodLength) ||
+            (!dynamicRAP && savedRAP1Length != RAP1Length)))
+        throw cRuntimeError("MAC checkpoint %s was saved with allocation slot %d ms, beacon period %d, RAP1 %d, "
+                "this run uses %d ms, %d, %d", checkpointPath().c_str(), savedAllocationSlotLength,
+                savedBeaconPeriodLength, savedRAP1Length, (int)round(allocationSlotLength * 1000),
+                beaconPeriodLength, RAP1Length);
+    allocationSlotLength = savedAllocationSlotLength / 1000.0;
+    beaconPeriodLength = savedBeaconPeriodLength;
+    RAP1Length = savedRAP1Length;
+    CW = readCheckpointInt(in);
+    CWdouble = readCheckpointInt(in) != 0;
+
+    if (isHub) {
+        currentFreeConnectedNID = readCheckpointInt(in);
+        currentFirstFreeSlot = readCheckpointInt(in);
+        naivePollingScheme = readCheckpointInt(in) != 0;
+        readCheckpointMap(in, slotAssignmentMap);
+        readCheckpointMap(in, downlinkAssignmentMap);
+        nodeWakeupInterval.clear();
+        for (int i = readCheckpointInt(in); i > 0 && in; i--) {
+            int address = readCheckpointInt(in);
+            nodeWakeupInterval[address] = readCheckpointInt(in);
+        }
+        joinedNIDs.clear();
+        for (int i = readCheckpointInt(in); i > 0 && in; i--) joinedNIDs.insert(readCheckpointInt(in));
+        for (int i = readCheckpointInt(in); i > 0 && in; i--) {
+            int nid = readCheckpointInt(in);
+            int scheduled = readCheckpointInt(in);
+            if (nid < 0 || nid >= HUB_NID_TABLE_SIZE) continue;
+            lastTxAccessSlot[nid].scheduled = scheduled;
+        }
+        configuredBeaconPeriod = beaconPeriodLength * allocationSlotLength;
+        pendingAllocationSlotLength = (int)round(allocationSlotLength * 1000);
+        pendingBeaconPeriodLength = beaconPeriodLength;
+        rebuildHubSchedule();
+        slotCarriedFrame.assign(beaconPeriodLength + 2, false);
+    } else {
+        connectedNID = readCheckpointInt(in);
+        unconnectedNID = readCheckpointInt(in);
+        scheduledTxAccessStart = readCheckpointInt(in);
+        scheduledTxAccessEnd = readCheckpointInt(in);
+        scheduledRxAccessStart = readCheckpointInt(in);
+        scheduledRxAccessEnd = readCheckpointInt(in);
+        scheduledAccessPeriod = readCheckpointInt(in);
+        scheduledAccessLength = readCheckpointInt(in);
+    }
+    if (!in) throw cRuntimeError("MAC checkpoint %s is truncated", checkpointPath().c_str());
+    trace() << "MAC state restored from " << checkpointPath() << ", HID " << connectedHID
+            << (isHub ? "" : ", NID " + to_string(connectedNID));
+    return true;
+}
+
+/* Fixed memory, log-bucketed latency histogram (in the spirit of HDR histograms).
+ * Values are recorded in microseconds. Below 8us every value has its own bucket,
+ * above that every power of two is split in 8 linear sub-buckets, so a bucket is
+ * never wider than 1/8 of its lower bound. Counters are only allocated on the
+ * first record, so unused histograms cost nothing.
+ */
+class LatencyHistogram {
+  public:
+    LatencyHistogram() : total(0), maxValue(0) {}
+
+    void record(simtime_t latency) {
+        long value = (long)(SIMTIME_DBL(latency) * 1e6);
+        if (value < 0) value = 0;
+        if (counts.empty()) counts.assign(NUM_BUCKETS, 0);
+        counts[bucketOf(value)]++;
+        total++;
+        if (value > maxValue) maxValue = value;
+    }
+
+    long count() const { return total; }
+    double maxMs() const { return maxValue / 1000.0; }
+
+    // Upper bound (in ms) of the bucket that holds the given percentile
+    double percentileMs(double percentile) const {
+        if (total == 0) return 0;
+        long rank = (long)ceil(percentile / 100.0 * total);
+        if (rank < 1) rank = 1;
+        long seen = 0;
+        for (int i = 0; i < NUM_BUCKETS; i++) {
+            seen += counts[i];
+            if (seen >= rank) return min(bucketUpperBound(i), maxValue) / 1000.0;
+        }
+        return maxValue / 1000.0;
+    }
+
+  private:
+    static const int SUB_BUCKET_BITS = 3;
+    static const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static const int NUM_BUCKETS = 64 * SUB_BUCKETS;
+    vector<long> counts;
+    long total;
+    long maxValue;
+
+    static int bucketOf(long value) {
+        if (value < SUB_BUCKETS) return value;
+        int msb = 0;
+        while ((value >> (msb + 1)) != 0) msb++;
+        int index = SUB_BUCKETS * (msb - SUB_BUCKET_BITS + 1) + ((value >> (msb - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1));
+        return min(index, NUM_BUCKETS - 1);
+    }
+
+    static long bucketUpperBound(int index) {
+        if (index < SUB_BUCKETS) return index;
+        int shift = index / SUB_BUCKETS - 1;
+        int sub = index % SUB_BUCKETS;
+        return ((long)(SUB_BUCKETS + sub + 1) << shift) - 1;
+    }
+};
+
+static const char *latencyKindNames[] = {"acked", "delivered at hub", "dropped"};
+static const char *accessModeNames[] = {"RAP", "scheduled", "polled", "posted"};
+
+// Record the time since pkt was stamped in fromNetworkLayer()
+void BaselineBANMac::recordLatency(BaselineMacPacket *pkt, int kind, int accessMode) {
+    int up = pkt->getPriority();
+    if (up < 0 || up > 7) return;
+    simtime_t latency = simTime() - pkt->getTimestamp();
+    latencyByUP[kind][up].record(latency);
+    if (kind != LATENCY_DROPPED) latencyByAccessMode[accessMode].record(latency);
+}
+
+void BaselineBANMac::collectLatencyOutput(const char *output, const string &label, const LatencyHistogram &histogram) {
+    if (histogram.count() == 0) return;
+    collectOutput(output, label + " count", histogram.count());
+    collectOutput(output, label + " p50", histogram.percentileMs(50));
+    collectOutput(output, label + " p90", histogram.percentileMs(90));
+    collectOutput(output, label + " p99", histogram.percentileMs(99));
+    collectOutput(output, label + " p99.9", histogram.percentileMs(99.9));
+    collectOutput(output, label + " max", histogram.maxMs());
+}
+
+/* Fixed capacity circular buffer of integer samples. When full, the oldest
+ * sample is overwritten, so memory use does not depend on the traffic.
+ */
+class SampleRing {
+  public:
+    SampleRing() : head(0), size(0) {}
+
+    void add(int value) {
+        values[head] = value;
+        head = (head + 1) % SAMPLE_RING_CAPACITY;
+        if (size < SAMPLE_RING_CAPACITY) size++;
+    }
+
+    void clear() { head = 0; size = 0; }
+    bool empty() const { return size == 0; }
+
+    double mean() const {
+        if (size == 0) return 0;
+        double sum = 0;
+        for (int i = 0; i < size; i++) sum += values[i];
+        return sum / size;
+    }
+
+    int max() const {
+        int result = 0;
+        for (int i = 0; i < size; i++) if (values[i] > result) result = values[i];
+        return result;
+    }
+
+  private:
+    static const int SAMPLE_RING_CAPACITY = 64;
+    int values[SAMPLE_RING_CAPACITY];
+    int head;
+    int size;
+};
+
+/* Queue occupancy and slot utilization monitoring. Queue depths are sampled
+ * whenever the queues change (packet arrival, attemptTX(), poll handling), never
+ * from a timer of their own. Once per beacon period the samples are summarized
+ * into output vectors and the buffers start over.
+ */
+void BaselineBANMac::sampleQueues() {
+    txBufferSamples.add(TXBuffer.size());
+    mgmtBufferSamples.add(MgmtBuffer.size());
+    if (isHub) pollTimerSamples.add(hubPollTimers.size());
+}
+
+void BaselineBANMac::markSlotUsed(int slot) {
+    if (slot >= 1 && slot < (int)slotCarriedFrame.size()) slotCarriedFrame[slot] = true;
+}
+
+void BaselineBANMac::emitSuperframeSamples() {
+    if (!txBufferSamples.empty()) {
+        txBufferMeanVector.record(txBufferSamples.mean());
+        txBufferMaxVector.record(txBufferSamples.max());
+    }
+    if (!mgmtBufferSamples.empty()) mgmtBufferMaxVector.record(mgmtBufferSamples.max());
+    if (!pollTimerSamples.empty()) pollTimersMaxVector.record(pollTimerSamples.max());
+
+    // Slots that carried at least one data frame against the slots allocated for data
+    int slotsUsed = 0;
+    for (int i = 1; i < (int)slotCarriedFrame.size(); i++) if (slotCarriedFrame[i]) slotsUsed++;
+    int slotsAllocated = isHub ? scheduleManager.allocatedSlots() : max(0, scheduledTxAccessEnd - scheduledTxAccessStart);
+    if (slotsAllocated > 0 || slotsUsed > 0) {
+        slotsAllocatedVector.record(slotsAllocated);
+        slotsUsedVector.record(slotsUsed);
+    }
+
+    txBufferSamples.clear();
+    mgmtBufferSamples.clear();
+    pollTimerSamples.clear();
+    slotCarriedFrame.assign(beaconPeriodLength + 2, false);
+}
+
+/* Bounded, priority aware TXBuffer. Besides macBufferSize (total packets) the
+ * buffer is capped in bytes (macBufferBytes) and per user priority, in packets
+ * (upBufferSize) and bytes (upBufferBytes). A cap of 0 means no cap. When a new
+ * packet does not fit, bufferOverflowPolicy decides:
+ *   tailDrop     - the new packet is dropped
+ *   dropLowestUP - the oldest packet of the lowest UP below the new one is dropped
+ *   dropOldest   - the oldest UP0-UP3 packet is dropped (stale low priority data),
+ *                  UP4-UP7 packets are never evicted
+ * Evictions repeat until the new packet fits. Returns true if pkt was queued.
+ */
+bool BaselineBANMac::admitToTXBuffer(BaselineMacPacket *pkt) {
+    int up = pkt->getPriority();
+    if (up < 0 || up > 7) up = 0;
+    int bytes = pkt->getByteLength();
+
+    while (true) {
+        bool upFull = (upBufferSize > 0 && txBufferPacketsByUP[up] + 1 > upBufferSize) ||
+                (upBufferBytes > 0 && txBufferBytesByUP[up] + bytes > upBufferBytes);
+        bool totalFull = (macBufferSize > 0 && (int)TXBuffer.size() + 1 > macBufferSize) ||
+                (macBufferBytes > 0 && txBufferBytes + bytes > macBufferBytes);
+        if (!upFull && !totalFull) break;
+
+        BaselineMacPacket *victim = NULL;
+        if (bufferOverflowPolicy == BUFFER_DROP_OLDEST && up <= 3) {
+            // Stale low priority data goes first, within the UP if that is the full cap
+            victim = evictFromTXBuffer(upFull ? up : 0, upFull ? up : 3, false);
+        } else if (bufferOverflowPolicy == BUFFER_DROP_OLDEST && !upFull) {
+            victim = evictFromTXBuffer(0, 3, false);
+        } else if (bufferOverflowPolicy == BUFFER_DROP_LOWEST_UP && !upFull && up > 0) {
+            victim = evictFromTXBuffer(0, up - 1, true);
+        }
+        if (victim == NULL) return false;
+
+        int victimUP = victim->getPriority();
+        trace() << "Buffer full, evicting UP" << victimUP << " packet for UP" << up << " packet";
+        collectDataOutcome(victim, "Fail, buffer overflow");
+        recordLatency(victim, LATENCY_DROPPED, currentAccessMode());
+        cancelAndDelete(victim);
+    }
+
+    // Sequence number of the data frame, it lets the hub recognize a retransmission
+    pkt->setSequenceNumber(nextDataSequenceNumber);
+    nextDataSequenceNumber = (nextDataSequenceNumber + 1) % 256;
+    TXBuffer.push(pkt);
+    accountTXBuffer(pkt, 1);
+    return true;
+}
+
+/* Data delivery outcomes, in total and per user priority (0-7). Sensors count
+ * "Success, 1st try", "Success, 2 or more tries", "Failed, No Ack", "Failed, Channel busy"
+ * and "Fail, buffer overflow", the hub "Received at hub" and "Duplicate at hub".
+ */
+void BaselineBANMac::collectDataOutcome(BaselineMacPacket *pkt, const char *outcome) {
+    int up = pkt->getPriority();
+    if (up < 0 || up > 7) up = 0;
+    collectOutput("Data pkt breakdown", outcome);
+    collectOutput("Data pkt breakdown per UP", up, outcome);
+}
+
+// Same sequence number as the last data frame from this NID: a retransmission
+bool BaselineBANMac::isDuplicateData(BaselineMacPacket *pkt) {
+    map<int, int>::iterator iter = lastDataSequenceNumber.find(pkt->getNID());
+    bool duplicate = (iter != lastDataSequenceNumber.end() && iter->second == (int)pkt->getSequenceNumber());
+    lastDataSequenceNumber[pkt->getNID()] = pkt->getSequenceNumber();
+    return duplicate;
+}
+
+/* Take out of TXBuffer the oldest packet with UP in [minUP, maxUP], or, if
+ * lowestFirst, the oldest packet of the lowest such UP. The order of the other
+ * packets is kept. Returns NULL if there is no such packet.
+ */
+BaselineMacPacket *BaselineBANMac::evictFromTXBuffer(int minUP, int maxUP, bool lowestFirst) {
+    int queued = TXBuffer.size();
+    int victimIndex = -1;
+    int victimUP = 8;
+    for (int i = 0; i < queued; i++) {
+        BaselineMacPacket *pkt = (BaselineMacPacket*)TXBuffer.front();
+        TXBuffer.pop();
+        TXBuffer.push(pkt);
+        int up = pkt->getPriority();
+        if (up < minUP || up > maxUP) continue;
+        if (victimIndex < 0 || (lowestFirst && up < victimUP)) {
+            victimIndex = i;
+            victimUP = up;
+        }
+    }
+    if (victimIndex < 0) return NULL;
+
+    BaselineMacPacket *victim = NULL;
+    for (int i = 0; i < queued; i++) {
+        BaselineMacPacket *pkt = (BaselineMacPacket*)TXBuffer.front();
+        TXBuffer.pop();
+        if (i == victimIndex) victim = pkt;
+        else TXBuffer.push(pkt);
+    }
+    accountTXBuffer(victim, -1);
+    return victim;
+}
+
+BaselineMacPacket *BaselineBANMac::popTXBuffer() {
+    BaselineMacPacket *pkt = (BaselineMacPacket*)TXBuffer.front();
+    TXBuffer.pop();
+    accountTXBuffer(pkt, -1);
+    return pkt;
+}
+
+// Keep the per UP packet and byte counts of TXBuffer, sign is +1 on push, -1 on removal
+void BaselineBANMac::accountTXBuffer(BaselineMacPacket *pkt, int sign) {
+    int up = pkt->getPriority();
+    if (up < 0 || up > 7) up = 0;
+    txBufferPacketsByUP[up] += sign;
+    txBufferBytesByUP[up] += sign * pkt->getByteLength();
+    txBufferBytes += sign * pkt->getByteLength();
+}
+
+/* Hub downlink. Data for a connected node waits in the node's own queue until the
+ * node is known to be awake. At every beacon the hub reserves a post, a run of free
+ * slots for the node's downlink later in the superframe, for each node awake in it,
+ * and announces it with a future POLL sent in the RAP. When it acknowledges an
+ * uplink frame, the I-ACK becomes an I-ACK-POLL announcing a post as well, for
+ * downlink queued after the beacon. The node wakes up for it through
+ * START_POSTED_ACCESS, and every downlink frame's moreData tells it whether to
+ * stay awake for the next slot. Queues are capped at macBufferSize packets.
+ */
+bool BaselineBANMac::queueDownlink(BaselineMacPacket *pkt, int dst) {
+    map<int, slotAssign_t>::iterator iter = slotAssignmentMap.find(dst);
+    if (iter == slotAssignmentMap.end()) return false;
+
+    queue<BaselineMacPacket*> &downlink = downlinkQueues[iter->second.NID];
+    if (macBufferSize > 0 && (int)downlink.size() >= macBufferSize) {
+        trace() << "WARNING BaselineBAN MAC downlink buffer overflow, NID " << iter->second.NID;
+        collectDataOutcome(pkt, "Fail, buffer overflow");
+        recordLatency(pkt, LATENCY_DROPPED, currentAccessMode());
+        cancelAndDelete(pkt);
+        return true;
+    }
+    pkt->setNID(iter->second.NID);
+    downlink.push(pkt);
+    return true;
+}
+
+int BaselineBANMac::downlinkPending(int NID) {
+    map<int, queue<BaselineMacPacket*> >::iterator iter = downlinkQueues.find(NID);
+    return (iter == downlinkQueues.end()) ? 0 : iter->second.size();
+}
+
+// Head of the downlink queue of the node owning the current downlink run, NULL if none
+BaselineMacPacket *BaselineBANMac::nextDownlinkPacket() {
+    const SlotOwner &owner = scheduleManager.owner(currentSlot);
+    if (owner.direction != SLOT_DOWNLINK || owner.NID == BROADCAST_NID) return NULL;
+    if (downlinkPending(owner.NID) == 0) return NULL;
+    return downlinkQueues[owner.NID].front();
+}
+
+/* Reserve a post for NID's pending downlink in the free slots of this superframe.
+ * The run covers the queue (frame, I-ACK and turnarounds per packet) or the longest
+ * free run there is. Returns the first slot of the post, -1 if none was reserved.
+ */
+int BaselineBANMac::scheduleDownlinkPost(int NID) {
+    int pending = downlinkPending(NID);
+    if (pending == 0 || downlinkPostSlot.find(NID) != downlinkPostSlot.end()) return -1;
+
+    simtime_t needed = 0;
+    queue<BaselineMacPacket*> downlink = downlinkQueues[NID];
+    while (!downlink.empty()) {
+        needed += TX_TIME(downlink.front()->getByteLength()) + TX_TIME(BASELINEBAN_HEADER_SIZE) + 2 * pTIFS;
+        downlink.pop();
+    }
+    int slots = max(1, (int)ceil(SIMTIME_DBL(needed) / allocationSlotLength));
+    for (; slots > 0; slots--) {
+        int start = scheduleManager.findFreeRun(slots, currentSlot + 1, beaconPeriodLength + 1);
+        if (start < 0) continue;
+        scheduleManager.assign(NID, SLOT_DOWNLINK, SLOT_PHASE_POLL, start, start + slots);
+        downlinkPostSlot[NID] = start;
+        trace() << "Downlink post for NID " << NID << ": slots " << start << "-" << start + slots - 1
+                << " for " << pending << " pkts";
+        collectOutput("var stats", "downlink post slots given", slots);
+        return start;
+    }
+    return -1;
+}
+
+// Whether NID is awake in the current beacon period. A node with a wakeup interval above
+// one only listens every interval-th beacon period, counted from the one it was last heard in
+bool BaselineBANMac::nodeAwakeThisSuperframe(int NID) {
+    map<int, int>::iterator heard = nodeHeardInBeacon.find(NID);
+    if (heard == nodeHeardInBeacon.end()) return true;
+    int interval = 1;
+    for (map<int, slotAssign_t>::iterator iter = slotAssignmentMap.begin(); iter != slotAssignmentMap.end(); iter++) {
+        if (iter->second.NID != NID) continue;
+        if (nodeWakeupInterval.count(iter->first)) interval = nodeWakeupInterval[iter->first];
+        break;
+    }
+    return interval <= 1 || (hubBeaconCount - heard->second) % interval == 0;
+}
+
+// Offer a post to every node with pending downlink that is awake in this beacon period
+void BaselineBANMac::offerDownlinkPosts() {
+    for (map<int, queue<BaselineMacPacket*> >::iterator iter = downlinkQueues.begin(); iter != downlinkQueues.end(); iter++) {
+        if (iter->second.empty() || !nodeAwakeThisSuperframe(iter->first)) continue;
+        int postSlot = scheduleDownlinkPost(iter->first);
+        if (postSlot < 0) continue;
+
+        BaselineMacPacket *postPkt = new BaselineMacPacket("BaselineBAN Future Poll", MAC_LAYER_PACKET);
+        setHeaderFields(postPkt, N_ACK_POLICY, MANAGEMENT, POLL);
+        postPkt->setNID(iter->first);
+        postPkt->setSequenceNumber(postSlot);
+        postPkt->setFragmentNumber(0);
+        postPkt->setMoreData(1);
+        postPkt->setByteLength(BASELINEBAN_HEADER_SIZE);
+        trace() << "Created future POLL (post) for NID: " << iter->first << ", for slot " << postSlot;
+        pushManagement(postPkt);
+    }
+}
+
+// A downlink frame announced more data, keep the posted access open for one more slot
+void BaselineBANMac::extendPostedAccess() {
+    int slot = (int)round(SIMTIME_DBL(getClock() - frameStartTime) / allocationSlotLength) + 1;
+    // Within our scheduled RX access the hub keeps the rest for the next wakeup
+    if (slot >= scheduledRxAccessStart && slot < scheduledRxAccessEnd) return;
+    postedAccessEnd = max(postedAccessEnd, slot + 2);
+    if ((postedAccessEnd - 1) < beaconPeriodLength &&
+        postedAccessEnd != scheduledTxAccessStart && postedAccessEnd != scheduledRxAccessStart) {
+        planAction(START_SLEEPING, frameStartTime + (postedAccessEnd - 1) * allocationSlotLength - getClock());
+    } else cancelPlannedAction(START_SLEEPING);
+}
+
+/* Scheduled downlink (RX for the node) allocation of the node with fullAddress.
+ * An existing allocation of the requested length is kept, otherwise the old one
+ * is given back and a new run of free slots before the CAP is taken. The result
+ * (no slots if the request is 0 or cannot be met) goes in connAssignment.
+ */
+void BaselineBANMac::assignDownlink(BaselineConnectionAssignmentPacket *connAssignment, int fullAddress, int NID, int requested) {
+    map<int, slotAssign_t>::iterator iter = downlinkAssignmentMap.find(fullAddress);
+    if (iter != downlinkAssignmentMap.end() && iter->second.endSlot - iter->second.startSlot != requested) {
+        scheduleManager.release(iter->second.startSlot, iter->second.endSlot);
+        downlinkAssignmentMap.erase(iter);
+        iter = downlinkAssignmentMap.end();
+    }
+    if (iter == downlinkAssignmentMap.end() && requested > 0) {
+        int start = scheduleManager.findFreeRun(requested, RAP1Length + 1, scheduleManager.capStart());
+        if (start > 0) {
+            slotAssign_t downlink;
+            downlink.NID = NID;
+            downlink.startSlot = start;
+            downlink.endSlot = start + requested;
+            downlinkAssignmentMap[fullAddress] = downlink;
+            scheduleManager.assign(NID, SLOT_DOWNLINK, SLOT_PHASE_SCHEDULED, downlink.startSlot, downlink.endSlot);
+            if (downlink.endSlot > currentFirstFreeSlot) currentFirstFreeSlot = downlink.endSlot;
+            iter = downlinkAssignmentMap.find(fullAddress);
+            trace() << "Downlink slots " << downlink.startSlot << "-" << downlink.endSlot - 1 << " assigned to NID " << NID;
+        } else trace() << "No room for " << requested << " downlink slots of NID " << NID;
+    }
+    connAssignment->setDownlinkRequestStart(iter == downlinkAssignmentMap.end() ? 0 : iter->second.startSlot);
+    connAssignment->setDownlinkRequestEnd(iter == downlinkAssignmentMap.end() ? 0 : iter->second.endSlot);
+}
+
+/* Load adaptive polling. Per-ACK future polls cost nothing extra while few nodes
+ * have more data, but each takes the next free slot one by one; a batch of future
+ * polls in the first free slot (naive scheme) shares the free slots in proportion
+ * to demand and wins when many nodes want them. The load is the number of nodes
+ * that reported moreData in the last superframe over the free slots. The naive
+ * scheme is entered above naivePollingEnterLoad and left below naivePollingExitLoad,
+ * the band between the two keeps the hub from flapping between schemes.
+ */
+void BaselineBANMac::choosePollingScheme() {
+    int freeSlots = max(1, beaconPeriodLength - currentFirstFreeSlot + 1);
+    double load = (double)moreDataNIDs.size() / freeSlots;
+    bool naive = naivePollingScheme;
+    if (!naive && load >= naivePollingEnterLoad) naive = true;
+    else if (naive && load <= naivePollingExitLoad) naive = false;
+
+    if (naive != naivePollingScheme) {
+        trace() << "Polling scheme: " << (naive ? "naive" : "per-ACK") << " (" << moreDataNIDs.size()
+                << " nodes with more data, " << freeSlots << " free slots)";
+        collectOutput("var stats", "polling scheme switches");
+        // Demand reported before the last superframe is stale for the batch
+        if (naive)
+            for (int nid = 0; nid < HUB_NID_TABLE_SIZE; nid++)
+                if (!moreDataNIDs.count(nid)) reqToSendMoreData[nid] = 0;
+        naivePollingScheme = naive;
+    }
+    pollingModeVector.record(naivePollingScheme ? 1 : 0);
+    moreDataNIDs.clear();
+}
+
+/* Hub tuning of the allocation slot length and beacon period, every slotAdaptationPeriod
+ * beacons. Slots much longer than the frames exchanged in them waste the rest of the
+ * slot, so the slot is halved when the mean frame airtime (with its ACK exchange) fits
+ * in a quarter of it, and doubled when frames do not fit in one slot. Only halving and
+ * doubling are used: allocations then map exactly onto the new slots, and a sensor
+ * that slept through several changes still lands on its slots. Doubling needs every
+ * allocation boundary to be on an even slot. With the slot length unchanged, the
+ * beacon period grows when most connected nodes wake up less than every beacon, and
+ * shrinks back towards its configured length when most of them wake up every beacon.
+ * A change is announced for the longest wakeup interval plus one beacons, so every
+ * node hears it before it takes effect.
+ */
+void BaselineBANMac::planHubParameterChange() {
+    if (++beaconsSinceSlotAdaptation < slotAdaptationPeriod) return;
+    beaconsSinceSlotAdaptation = 0;
+
+    int slotMs = (int)round(allocationSlotLength * 1000);
+    int newSlotMs = slotMs;
+    if (adaptiveSlotLength && frameAirtimeCount > 0) {
+        double airtime = frameAirtimeSum / frameAirtimeCount;
+        bool aligned = RAP1Length % 2 == 0 && beaconPeriodLength % 2 == 0 && (currentFirstFreeSlot - 1) % 2 == 0;
+        for (map<int, slotAssign_t>::iterator iter = slotAssignmentMap.begin(); aligned && iter != slotAssignmentMap.end(); iter++)
+            aligned = (iter->second.startSlot - 1) % 2 == 0 && (iter->second.endSlot - 1) % 2 == 0;
+        for (map<int, slotAssign_t>::iterator iter = downlinkAssignmentMap.begin(); aligned && iter != downlinkAssignmentMap.end(); iter++)
+            aligned = (iter->second.startSlot - 1) % 2 == 0 && (iter->second.endSlot - 1) % 2 == 0;
+
+        if (airtime <= allocationSlotLength / 4 && slotMs % 2 == 0 && slotMs / 2 >= minAllocationSlotLength
+                && beaconPeriodLength * 2 <= maxBeaconPeriodLength)
+            newSlotMs = slotMs / 2;
+        else if (airtime > allocationSlotLength && slotMs * 2 <= maxAllocationSlotLength && aligned)
+            newSlotMs = slotMs * 2;
+    }
+    frameAirtimeSum = 0;
+    frameAirtimeCount = 0;
+
+    int newPeriodLength = beaconPeriodLength * slotMs / newSlotMs;
+    if (adaptiveBeaconPeriod && newSlotMs == slotMs && !nodeWakeupInterval.empty()) {
+        int sleeping = 0;
+        for (map<int, int>::iterator iter = nodeWakeupInterval.begin(); iter != nodeWakeupInterval.end(); iter++)
+            if (iter->second > 1) sleeping++;
+        int step = max(1, beaconPeriodLength / 4);
+        // Never cut into allocations or the CAP
+        int capSlots = beaconPeriodLength - scheduleManager.capStart() + 1;
+        int minLength = max((int)ceil(configuredBeaconPeriod / allocationSlotLength), scheduledSlotsEnd() - 1 + capSlots);
+        if (2 * sleeping > (int)nodeWakeupInterval.size())
+            newPeriodLength = min(maxBeaconPeriodLength, beaconPeriodLength + step);
+        else if (4 * sleeping < (int)nodeWakeupInterval.size())
+            newPeriodLength = max(min(minLength, beaconPeriodLength), beaconPeriodLength - step);
+    }
+    if (newSlotMs == slotMs && newPeriodLength == beaconPeriodLength) return;
+
+    int longestWakeupInterval = 1;
+    for (map<int, int>::iterator iter = nodeWakeupInterval.begin(); iter != nodeWakeupInterval.end(); iter++)
+        longestWakeupInterval = max(longestWakeupInterval, iter->second);
+    parameterChangeCountdown = longestWakeupInterval + 1;
+    pendingAllocationSlotLength = newSlotMs;
+    pendingBeaconPeriodLength = newPeriodLength;
+    trace() << "Announcing slot length " << slotMs << " -> " << newSlotMs << " ms, beacon period "
+            << beaconPeriodLength << " -> " << newPeriodLength << " slots in " << parameterChangeCountdown << " beacons";
+    collectOutput("var stats", "slot length/beacon period changes");
+}
+
+/* The announced change takes effect with this beacon. All scheduled allocations,
+ * the RAP and the batched assignments still to be delivered are rescaled to the
+ * new slot length (the same mapping sensors apply to their own slots) and the
+ * superframe layout is rebuilt from them.
+ */
+void BaselineBANMac::applyHubParameterChange() {
+    if (pendingAllocationSlotLength != (int)round(allocationSlotLength * 1000)) {
+        double factor = allocationSlotLength * 1000 / pendingAllocationSlotLength;
+        moveAllocations(factor, 0);
+        RAP1Length = (int)round(RAP1Length * factor);
+        allocationSlotLength = pendingAllocationSlotLength / 1000.0;
+    }
+    beaconPeriodLength = pendingBeaconPeriodLength;
+    rebuildHubSchedule();
+    slotCarriedFrame.assign(beaconPeriodLength + 2, false);
+
+    trace() << "Slot length now " << allocationSlotLength << " secs, beacon period " << beaconPeriodLength << " slots";
+    slotLengthVector.record(pendingAllocationSlotLength);
+    beaconPeriodVector.record(beaconPeriodLength);
+}
+
+/* Move every scheduled allocation with moveSlot(): the uplink and downlink maps,
+ * the last slots of the NIDs, the first free slot and the assignments not yet
+ * delivered (batched, or queued as frames), so that they match what the nodes
+ * derive from the next beacon.
+ */
+void BaselineBANMac::moveAllocations(double factor, int shift) {
+    for (map<int, slotAssign_t>::iterator iter = slotAssignmentMap.begin(); iter != slotAssignmentMap.end(); iter++) {
+        iter->second.startSlot = moveSlot(iter->second.startSlot, factor, shift);
+        iter->second.endSlot = moveSlot(iter->second.endSlot, factor, shift);
+        lastTxAccessSlot[iter->second.NID].scheduled = iter->second.endSlot - 1;
+    }
+    for (map<int, slotAssign_t>::iterator iter = downlinkAssignmentMap.begin(); iter != downlinkAssignmentMap.end(); iter++) {
+        iter->second.startSlot = moveSlot(iter->second.startSlot, factor, shift);
+        iter->second.endSlot = moveSlot(iter->second.endSlot, factor, shift);
+    }
+    currentFirstFreeSlot = moveSlot(currentFirstFreeSlot, factor, shift);
+
+    for (deque<ConnectionAssignmentEntry>::iterator iter = pendingAssignments.begin(); iter != pendingAssignments.end(); iter++) {
+        if (iter->uplinkRequestEnd > iter->uplinkRequestStart) {
+            iter->uplinkRequestStart = moveSlot(iter->uplinkRequestStart, factor, shift);
+            iter->uplinkRequestEnd = moveSlot(iter->uplinkRequestEnd, factor, shift);
+        }
+        if (iter->downlinkRequestEnd > iter->downlinkRequestStart) {
+            iter->downlinkRequestStart = moveSlot(iter->downlinkRequestStart, factor, shift);
+            iter->downlinkRequestEnd = moveSlot(iter->downlinkRequestEnd, factor, shift);
+        }
+    }
+    for (int i = MgmtBuffer.size(); i > 0; i--) {
+        BaselineMacPacket *mgmtPkt = MgmtBuffer.front();
+        MgmtBuffer.pop();
+        moveQueuedAssignment(mgmtPkt, factor, shift);
+        MgmtBuffer.push(mgmtPkt);
+    }
+    for (unsigned int i = 0; i < parkedManagement.size(); i++) moveQueuedAssignment(parkedManagement[i], factor, shift);
+}
+
+void BaselineBANMac::moveQueuedAssignment(BaselineMacPacket *pkt, double factor, int shift) {
+    if (pkt->getFrameSubtype() != CONNECTION_ASSIGNMENT) return;
+    BaselineConnectionAssignmentPacket *connAssignment = check_and_cast<BaselineConnectionAssignmentPacket*>(pkt);
+    if (connAssignment->getUplinkRequestEnd() > connAssignment->getUplinkRequestStart()) {
+        connAssignment->setUplinkRequestStart(moveSlot(connAssignment->getUplinkRequestStart(), factor, shift));
+        connAssignment->setUplinkRequestEnd(moveSlot(connAssignment->getUplinkRequestEnd(), factor, shift));
+    }
+    if (connAssignment->getDownlinkRequestEnd() > connAssignment->getDownlinkRequestStart()) {
+        connAssignment->setDownlinkRequestStart(moveSlot(connAssignment->getDownlinkRequestStart(), factor, shift));
+        connAssignment->setDownlinkRequestEnd(moveSlot(connAssignment->getDownlinkRequestEnd(), factor, shift));
+    }
+}
+
+/* The hub's superframe layout from its current geometry. EAP and CAP lengths are
+ * converted to allocation slots, and the scheduled uplink and downlink allocations
+ * are put back in.
+ */
+void BaselineBANMac::rebuildHubSchedule() {
+    int eapSlots = (int)ceil(numEapSlots * eapSlotLength / allocationSlotLength);
+    int capSlots = (int)ceil(numCapSlots * capSlotLength / allocationSlotLength);
+    scheduleManager.reset(beaconPeriodLength, min(eapSlots, RAP1Length), RAP1Length, capSlots);
+    // Phase boundaries, advertised in the beacon
+    EAP1Length = min(eapSlots, RAP1Length);
+    CAPStart = (capSlots > 0) ? scheduleManager.capStart() : 0;
+    for (map<int, slotAssign_t>::iterator iter = slotAssignmentMap.begin(); iter != slotAssignmentMap.end(); iter++)
+        scheduleManager.assign(iter->second.NID, SLOT_UPLINK, SLOT_PHASE_SCHEDULED, iter->second.startSlot, iter->second.endSlot);
+    for (map<int, slotAssign_t>::iterator iter = downlinkAssignmentMap.begin(); iter != downlinkAssignmentMap.end(); iter++)
+        scheduleManager.assign(iter->second.NID, SLOT_DOWNLINK, SLOT_PHASE_SCHEDULED, iter->second.startSlot, iter->second.endSlot);
+}
+
+// End (exclusive) of the last scheduled allocation, or the first free slot if it is further
+int BaselineBANMac::scheduledSlotsEnd() {
+    int end = currentFirstFreeSlot;
+    for (map<int, slotAssign_t>::iterator iter = slotAssignmentMap.begin(); iter != slotAssignmentMap.end(); iter++)
+        end = max(end, iter->second.endSlot);
+    for (map<int, slotAssign_t>::iterator iter = downlinkAssignmentMap.begin(); iter != downlinkAssignmentMap.end(); iter++)
+        end = max(end, iter->second.endSlot);
+    return end;
+}
+
+/* Length of the next m beacon periods as seen by a sensor. Periods from the one
+ * ending in the beacon that applies an announced change on are of the new length.
+ */
+simtime_t BaselineBANMac::timeForBeaconPeriods(int m) {
+    simtime_t current = beaconPeriodLength * allocationSlotLength;
+    if (parameterChangeCountdown <= 0 || m <= parameterChangeCountdown) return m * current;
+    return parameterChangeCountdown * current + (m - parameterChangeCountdown) * pendingBeaconPeriodTime;
+}
+
+/* The hub changed its superframe: our slots are rescaled by factor (old over new
+ * slot length) and moved by shift slots with the end of RAP, as the hub did.
+ */
+void BaselineBANMac::moveOwnSchedule(double factor, int shift) {
+    if (scheduledTxAccessEnd > scheduledTxAccessStart) {
+        scheduledTxAccessStart = moveSlot(scheduledTxAccessStart, factor, shift);
+        scheduledTxAccessEnd = moveSlot(scheduledTxAccessEnd, factor, shift);
+    }
+    if (scheduledRxAccessEnd > scheduledRxAccessStart) {
+        scheduledRxAccessStart = moveSlot(scheduledRxAccessStart, factor, shift);
+        scheduledRxAccessEnd = moveSlot(scheduledRxAccessEnd, factor, shift);
+    }
+    trace() << "Superframe changed, scheduled access now TX " << scheduledTxAccessStart << "-" << scheduledTxAccessEnd
+            << ", RX " << scheduledRxAccessStart << "-" << scheduledRxAccessEnd;
+}
+
+/* Dynamic RAP length. During RAP the hub senses the channel at the start of every
+ * slot after the beacon and notes whether it decoded a frame in it. A slot that
+ * started busy and carried no decodable frame counts as a collision. A frame is
+ * credited to every slot it spans, from the one it started in (its arrival time
+ * less its airtime) to the one its reception ended in. At each beacon:
+ *  - RAP grows by a quarter when the collision or busy ratio of the last RAP reaches
+ *    rapExpandCollisionRatio or rapExpandBusyRatio, or when more than one connection
+ *    request came per two RAP slots (join storm),
+ *  - RAP shrinks by one slot when the busy ratio is below rapShrinkBusyRatio and no
+ *    join is in progress (no request heard, no assignment waiting for delivery).
+ * Growing is fast and shrinking slow, so a join storm gets room quickly and the
+ * slots go back to scheduled and polled access once it is over. Scheduled
+ * allocations start right after RAP, so they all move with its end: the beacon
+ * carries the new RAP1 length and nodes move their own slots by the difference.
+ * RAP stays within [minRAP1Length, maxRAP1Length] and only grows into free slots.
+ * It is left alone while a slot length change is announced.
+ */
+void BaselineBANMac::resizeRAP() {
+    int samples = rapBusySlots + rapIdleSlots;
+    if (samples == 0 || parameterChangeCountdown > 0) {
+        clearRAPStatistics();
+        return;
+    }
+    double busyRatio = (double)rapBusySlots / samples;
+    double collisionRatio = (double)rapCollisionSlots / samples;
+    bool joinStorm = 2 * rapJoinRequests > RAP1Length;
+
+    int newLength = RAP1Length;
+    if (collisionRatio >= rapExpandCollisionRatio || busyRatio >= rapExpandBusyRatio || joinStorm) {
+        int freeSlots = scheduleManager.capStart() - scheduledSlotsEnd();
+        newLength = min(RAP1Length + min(max(1, RAP1Length / 4), max(0, freeSlots)), maxRAP1Length);
+    } else if (busyRatio < rapShrinkBusyRatio && rapJoinRequests == 0 && pendingAssignments.empty()) {
+        newLength = max(RAP1Length - 1, minRAP1Length);
+    }
+
+    if (newLength != RAP1Length) {
+        trace() << "RAP1 " << RAP1Length << " -> " << newLength << " slots (busy " << busyRatio << ", collisions "
+                << collisionRatio << ", " << rapJoinRequests << " connection requests, " << rapFramesHeard << " frames)";
+        collectOutput("var stats", newLength > RAP1Length ? "RAP expansions" : "RAP reductions");
+        moveAllocations(1, newLength - RAP1Length);
+        RAP1Length = newLength;
+        rebuildHubSchedule();
+    }
+    rapLengthVector.record(RAP1Length);
+    clearRAPStatistics();
+}
+
+void BaselineBANMac::sampleRAPSlot() {
+    rapSlotBusy = false;
+    rapSlotHeard = false;
+    rapSlotSampled = false;
+    // Slot 1 starts with our own beacon
+    if (currentSlot < 2) return;
+    CCAResult CCAcode = radioModule->isChannelClear();
+    if (CCAcode != CLEAR && CCAcode != BUSY) return;
+    rapSlotSampled = true;
+    rapSlotBusy = (CCAcode == BUSY);
+}
+
+void BaselineBANMac::closeRAPSlot() {
+    if (!rapSlotSampled) return;
+    if (rapSlotBusy) {
+        rapBusySlots++;
+        if (!rapSlotHeard) {
+            rapCollisionSlots++;
+            // Taken back if a frame that started in this slot is decoded in a later one
+            if (currentSlot < (int)rapSlotCollision.size()) rapSlotCollision[currentSlot] = true;
+        }
+    } else rapIdleSlots++;
+    rapSlotSampled = false;
+}
+
+void BaselineBANMac::clearRAPStatistics() {
+    rapBusySlots = 0;
+    rapIdleSlots = 0;
+    rapCollisionSlots = 0;
+    rapSlotCollision.assign(RAP1Length + 2, false);
+    rapFramesHeard = 0;
+    rapJoinRequests = 0;
+    rapSlotBusy = false;
+    rapSlotHeard = false;
+    rapSlotSampled = false;
+}
+
+// Arm SEND_POLL for the start of the earliest pending grant
+void BaselineBANMac::armPollTimer() {
+    if (hubPollTimers.empty()) {
+        cancelTimer(SEND_POLL);
+        return;
+    }
+    simtime_t pollTime = frameStartTime + (PollTimeline::startOf(hubPollTimers.top()) - 1) * allocationSlotLength;
+    setTimer(SEND_POLL, max(pollTime - getClock(), SIMTIME_ZERO));
+}
+
+/* NID reported no more data: its pending grants, and what is left of the grant it
+ * is using now, go back to the schedule so the slots can be given to others.
+ */
+void BaselineBANMac::cancelPollGrants(int NID) {
+    vector<TimerInfo> cancelled = hubPollTimers.cancel(NID);
+    for (unsigned int i = 0; i < cancelled.size(); i++) {
+        scheduleManager.release(PollTimeline::startOf(cancelled[i]), cancelled[i].endSlot + 1);
+        collectOutput("var stats", "poll slots cancelled", cancelled[i].slotsGiven);
+    }
+    if (activePollGrant.NID == NID && activePollGrant.endSlot > currentSlot) {
+        scheduleManager.release(currentSlot + 1, activePollGrant.endSlot + 1);
+        collectOutput("var stats", "poll slots cancelled", activePollGrant.endSlot - currentSlot);
+        activePollGrant.endSlot = currentSlot;
+    }
+    if (!cancelled.empty()) armPollTimer();
+}
+
+/* I-ACK (or I-ACK-POLL) for pkt. The hub acknowledges every uplink data frame,
+ * so it keeps a ready made ACK per connected NID and kind and only duplicates it;
+ * the caller patches the poll fields. Sensors, and an unconnected hub, build the
+ * ACK from scratch.
+ */
+BaselineMacPacket *BaselineBANMac::createAck(BaselineMacPacket *pkt, bool poll) {
+    int NID = pkt->getNID();
+    if (isHub && connectedHID != UNCONNECTED && NID >= 0 && NID < 256) {
+        vector<BaselineMacPacket*> &templates = ackTemplates[poll ? 1 : 0];
+        if (templates.empty()) templates.assign(256, (BaselineMacPacket*)NULL);
+        if (templates[NID] == NULL) {
+            BaselineMacPacket *ackTemplate = new BaselineMacPacket("ACK packet", MAC_LAYER_PACKET);
+            setHeaderFields(ackTemplate, N_ACK_POLICY, CONTROL, (poll ? I_ACK_POLL : I_ACK));
+            ackTemplate->setNID(NID);
+            ackTemplate->setByteLength(BASELINEBAN_HEADER_SIZE);
+            templates[NID] = ackTemplate;
+        }
+        return templates[NID]->dup();
+    }
+
+    BaselineMacPacket *ackPacket = new BaselineMacPacket("ACK packet", MAC_LAYER_PACKET);
+    setHeaderFields(ackPacket, N_ACK_POLICY, CONTROL, (poll ? I_ACK_POLL : I_ACK));
+    ackPacket->setNID(NID);
+    ackPacket->setByteLength(BASELINEBAN_HEADER_SIZE);
+    // If we are unconnected, set a proper HID (the packet is for us since it was not filtered)
+    if (connectedHID == UNCONNECTED) {
+        ackPacket->setHID(pkt->getHID());
+    }
+    return ackPacket;
+}
+
+/* Management retry queue. MgmtBuffer holds at most one frame per (subtype,
+ * destination): a newer frame replaces the queued one in place and inherits its
+ * retry budget. The budget is counted in rounds of maxPacketTries; a frame that
+ * uses up a round without being acknowledged is parked and put back in MgmtBuffer
+ * at the next beacon, until managementRetryRounds rounds are spent.
+ */
+int BaselineBANMac::managementDestination(BaselineMacPacket *pkt) {
+    if (BaselineConnectionRequestPacket *request = dynamic_cast<BaselineConnectionRequestPacket*>(pkt))
+        return request->getRecipientAddress();
+    if (BaselineConnectionAssignmentPacket *assignment = dynamic_cast<BaselineConnectionAssignmentPacket*>(pkt))
+        return assignment->getRecipientAddress();
+    return pkt->getNID();
+}
+
+bool BaselineBANMac::sameManagementKey(BaselineMacPacket *a, BaselineMacPacket *b) {
+    return a->getFrameSubtype() == b->getFrameSubtype() && managementDestination(a) == managementDestination(b);
+}
+
+void BaselineBANMac::pushManagement(BaselineMacPacket *pkt) {
+    // The same frame is on the air right now, it already carries what this one would
+    if (packetToBeSent && packetToBeSent->getFrameType() != DATA && sameManagementKey(packetToBeSent, pkt)) {
+        BaselineConnectionRequestPacket *inFlight = dynamic_cast<BaselineConnectionRequestPacket*>(packetToBeSent);
+        BaselineConnectionRequestPacket *request = dynamic_cast<BaselineConnectionRequestPacket*>(pkt);
+        // ...unless it is a request asking for something else (a renegotiation), that one is queued
+        if (inFlight == NULL || (inFlight->getUplinkRequest() == request->getUplinkRequest() &&
+                inFlight->getDownlinkRequest() == request->getDownlinkRequest() &&
+                inFlight->getWakeupInterval() == request->getWakeupInterval())) {
+            trace() << "Management frame " << pkt->getName() << " already in flight, dropping duplicate";
+            collectOutput("var stats", "management duplicates dropped");
+            cancelAndDelete(pkt);
+            return;
+        }
+    }
+
+    int roundsLeft = managementRetryRounds;
+    for (unsigned int i = 0; i < parkedManagement.size(); i++) {
+        if (!sameManagementKey(parkedManagement[i], pkt)) continue;
+        roundsLeft = managementRoundsLeft[parkedManagement[i]];
+        managementRoundsLeft.erase(parkedManagement[i]);
+        cancelAndDelete(parkedManagement[i]);
+        parkedManagement.erase(parkedManagement.begin() + i);
+        break;
+    }
+
+    bool replaced = false;
+    int queued = MgmtBuffer.size();
+    for (int i = 0; i < queued; i++) {
+        BaselineMacPacket *queuedPkt = (BaselineMacPacket*)MgmtBuffer.front();
+        MgmtBuffer.pop();
+        if (!replaced && sameManagementKey(queuedPkt, pkt)) {
+            roundsLeft = managementRoundsLeft[queuedPkt];
+            managementRoundsLeft.erase(queuedPkt);
+            cancelAndDelete(queuedPkt);
+            queuedPkt = pkt;
+            replaced = true;
+            collectOutput("var stats", "management frames replaced in queue");
+        }
+        MgmtBuffer.push(queuedPkt);
+    }
+    if (!replaced) MgmtBuffer.push(pkt);
+    // A POLL names slots of the current beacon period only, it never gets a later round
+    if (pkt->getFrameSubtype() != POLL) managementRoundsLeft[pkt] = roundsLeft;
+}
+
+// Called when pkt used up maxPacketTries. Returns true if it was parked for a later round
+bool BaselineBANMac::parkManagementForRetry(BaselineMacPacket *pkt) {
+    map<BaselineMacPacket*, int>::iterator iter = managementRoundsLeft.find(pkt);
+    if (iter == managementRoundsLeft.end() || iter->second <= 1) {
+        if (iter != managementRoundsLeft.end()) managementRoundsLeft.erase(iter);
+        return false;
+    }
+    iter->second--;
+    parkedManagement.push_back(pkt);
+    trace() << "Management frame " << pkt->getName() << " parked, " << iter->second << " rounds left";
+    return true;
+}
+
+void BaselineBANMac::requeueParkedManagement() {
+    for (unsigned int i = 0; i < parkedManagement.size(); i++) MgmtBuffer.push(parkedManagement[i]);
+    parkedManagement.clear();
+}
+
+bool BaselineBANMac::isManagementPending(int subtype) {
+    if (packetToBeSent && packetToBeSent->getFrameType() != DATA && packetToBeSent->getFrameSubtype() == subtype) return true;
+    for (unsigned int i = 0; i < parkedManagement.size(); i++)
+        if (parkedManagement[i]->getFrameSubtype() == subtype) return true;
+    bool found = false;
+    int queued = MgmtBuffer.size();
+    for (int i = 0; i < queued; i++) {
+        BaselineMacPacket *pkt = (BaselineMacPacket*)MgmtBuffer.front();
+        MgmtBuffer.pop();
+        if (pkt->getFrameSubtype() == subtype) found = true;
+        MgmtBuffer.push(pkt);
+    }
+    return found;
+}
+
+// Drop the queued and parked frames of subtype, a frame in flight is left to finish
+void BaselineBANMac::purgeManagement(int subtype) {
+    for (unsigned int i = 0; i < parkedManagement.size(); ) {
+        if (parkedManagement[i]->getFrameSubtype() != subtype) { i++; continue; }
+        managementRoundsLeft.erase(parkedManagement[i]);
+        cancelAndDelete(parkedManagement[i]);
+        parkedManagement.erase(parkedManagement.begin() + i);
+    }
+    int queued = MgmtBuffer.size();
+    for (int i = 0; i < queued; i++) {
+        BaselineMacPacket *pkt = (BaselineMacPacket*)MgmtBuffer.front();
+        MgmtBuffer.pop();
+        if (pkt->getFrameSubtype() != subtype) {
+            MgmtBuffer.push(pkt);
+            continue;
+        }
+        managementRoundsLeft.erase(pkt);
+        cancelAndDelete(pkt);
+    }
+}
+
+/* Bring a pending connection request to the hub that sent beacon up to date (the
+ * next wakeup refers to the beacon sequence number). Returns false if there is none.
+ */
+bool BaselineBANMac::refreshConnectionRequest(BaselineBeaconPacket *beacon) {
+    vector<BaselineMacPacket*> candidates(parkedManagement);
+    if (packetToBeSent) candidates.push_back(packetToBeSent);
+    int queued = MgmtBuffer.size();
+    for (int i = 0; i < queued; i++) {
+        candidates.push_back((BaselineMacPacket*)MgmtBuffer.front());
+        MgmtBuffer.push(MgmtBuffer.front());
+        MgmtBuffer.pop();
+    }
+    for (unsigned int i = 0; i < candidates.size(); i++) {
+        BaselineConnectionRequestPacket *request = dynamic_cast<BaselineConnectionRequestPacket*>(candidates[i]);
+        if (request == NULL || request->getRecipientAddress() != beacon->getSenderAddress()) continue;
+        request->setHID(beacon->getHID());
+        request->setNID(unconnectedNID);
+        request->setNextWakeup(beacon->getSequenceNumber() + 1);
+        return true;
+    }
+    return false;
+}
+
+/* Temporary NID of an unconnected node. With hashedJoin the NID is derived from
+ * our address, salted with the number of collisions seen, so a node that collided
+ * moves on to a different, still deterministic, one. Otherwise it is random as in
+ * the standard. Unconnected NIDs are only 1..15, so with more than a handful of
+ * nodes joining together collisions are expected either way: the hash does not
+ * avoid them, it makes them reproducible, and they are resolved as they are seen
+ * by unconnectedNIDCollision().
+ */
+int BaselineBANMac::pickUnconnectedNID() {
+    if (!hashedJoin) return 1 + genk_intrand(0, 14);
+    return 1 + joinHash(SELF_MAC_ADDRESS, joinNIDCollisions + 1) % 15;
+}
+
+// Another unconnected node uses our temporary NID, move to another one
+void BaselineBANMac::unconnectedNIDCollision() {
+    if (connectedHID != UNCONNECTED) return;
+    joinNIDCollisions++;
+    unconnectedNID = pickUnconnectedNID();
+    trace() << "Unconnected NID collision detected, switching to NID " << unconnectedNID;
+    collectOutput("Join", "unconnected NID collisions");
+    // Whatever the hub acknowledged or answered was the other node's request
+    connectionRequestAcked = false;
+}
+
+/* Batched connection assignments. Instead of one assignment frame per request, each
+ * contending in RAP, the hub keeps the pending assignments and carries up to
+ * maxBeaconAssignments of them in every beacon, least recently carried first.
+ * Accepted assignments stay pending until a frame of the assigned NID is heard,
+ * rejections are carried once (the node will ask again).
+ */
+void BaselineBANMac::queueBeaconAssignment(BaselineConnectionAssignmentPacket *connAssignment, int fullAddress) {
+    ConnectionAssignmentEntry assignment = assignmentEntryOf(connAssignment);
+    assignment.recipientAddress = fullAddress;
+    for (deque<ConnectionAssignmentEntry>::iterator iter = pendingAssignments.begin(); iter != pendingAssignments.end(); iter++) {
+        if (iter->recipientAddress != fullAddress) continue;
+        *iter = assignment;
+        return;
+    }
+    pendingAssignments.push_back(assignment);
+    trace() << "Connection assignment for " << fullAddress << " batched, " << pendingAssignments.size() << " pending";
+}
+
+void BaselineBANMac::addBeaconAssignments(BaselineBeaconPacket *beaconPkt) {
+    int count = min((int)pendingAssignments.size(), maxBeaconAssignments);
+    beaconPkt->setAssignmentsArraySize(count);
+    for (int i = 0; i < count; i++) {
+        ConnectionAssignmentEntry assignment = pendingAssignments.front();
+        pendingAssignments.pop_front();
+        beaconPkt->setAssignments(i, assignment);
+        if (assignment.statusCode == ACCEPTED || assignment.statusCode == MODIFIED)
+            pendingAssignments.push_back(assignment);
+    }
+    beaconPkt->setByteLength(beaconPkt->getByteLength() + count * BEACON_ASSIGNMENT_ENTRY_SIZE);
+    if (count > 0) collectOutput("var stats", "assignments carried in beacons", count);
+}
+
+void BaselineBANMac::confirmJoin(int NID) {
+    if (NID == BROADCAST_NID || NID == UNCONNECTED) return;
+    // Only NIDs the hub assigned count as joined (connected NIDs start from 16)
+    if (NID < 16 || NID >= currentFreeConnectedNID) return;
+    // Also for a node that joined before: this frame confirms a MODIFIED assignment as well
+    for (deque<ConnectionAssignmentEntry>::iterator iter = pendingAssignments.begin(); iter != pendingAssignments.end(); iter++) {
+        if (iter->assignedNID != NID) continue;
+        pendingAssignments.erase(iter);
+        break;
+    }
+    if (joinedNIDs.count(NID)) return;
+    joinedNIDs.insert(NID);
+    joinedNodesVector.record(joinedNIDs.size());
+    lastJoinTime = simTime();
+}
+
+/* Connection assignments reach a sensor either as their own frame or, when the hub
+ * batches them, as entries of a beacon. Both end up here.
+ */
+ConnectionAssignmentEntry BaselineBANMac::assignmentEntryOf(BaselineConnectionAssignmentPacket *connAssignment) {
+    ConnectionAssignmentEntry assignment;
+    assignment.recipientAddress = connAssignment->getRecipientAddress();
+    assignment.requesterNID = connAssignment->getRequesterNID();
+    assignment.wakeupInterval = connAssignment->getWakeupInterval();
+    assignment.HID = connAssignment->getHID();
+    assignment.statusCode = connAssignment->getStatusCode();
+    assignment.assignedNID = connAssignment->getAssignedNID();
+    assignment.uplinkRequestStart = connAssignment->getUplinkRequestStart();
+    assignment.uplinkRequestEnd = connAssignment->getUplinkRequestEnd();
+    assignment.downlinkRequestStart = connAssignment->getDownlinkRequestStart();
+    assignment.downlinkRequestEnd = connAssignment->getDownlinkRequestEnd();
+    return assignment;
+}
+
+void BaselineBANMac::applyConnectionAssignment(const ConnectionAssignmentEntry &assignment) {
+    bool wasConnected = (connectedHID != UNCONNECTED);
+    if (assignment.statusCode == ACCEPTED || assignment.statusCode == MODIFIED) {
+        connectedHID = assignment.HID;
+        connectedNID = assignment.assignedNID;
+        // Set anew the header fields of the packet to be sent
+        if (packetToBeSent) {
+            packetToBeSent->setHID(connectedHID);
+            packetToBeSent->setNID(connectedNID);
+        }
+        // Set the start and end times for the schedule
+        scheduledTxAccessStart = assignment.uplinkRequestStart;
+        scheduledTxAccessEnd = assignment.uplinkRequestEnd;
+        scheduledRxAccessStart = assignment.downlinkRequestStart;
+        scheduledRxAccessEnd = assignment.downlinkRequestEnd;
+        if (scheduledRxAccessEnd > scheduledRxAccessStart)
+            trace() << "scheduled RX access at slots " << scheduledRxAccessStart << "-" << scheduledRxAccessEnd - 1;
+        trace() << "connected as NID " << connectedNID << "  --start TX access at slot: " << scheduledTxAccessStart << ", end at slot: " << scheduledTxAccessEnd;
+        // The wakeup interval the hub granted applies from now on, starting with the next beacon wakeup
+        if (assignment.wakeupInterval > 0 && assignment.wakeupInterval != scheduledAccessPeriod) {
+            trace() << "Wakeup interval changed from " << scheduledAccessPeriod << " to " << assignment.wakeupInterval << " beacon periods";
+            scheduledAccessPeriod = assignment.wakeupInterval;
+            simtime_t sleepLength = frameStartTime + timeForBeaconPeriods(scheduledAccessPeriod) - getClock()
+                    + beaconShiftDelta(lastBeaconShiftIndex, lastBeaconShiftPhase, scheduledAccessPeriod);
+            planAction(WAKEUP_FOR_BEACON, sleepLength - beaconWakeupLead(sleepLength));
+            collectOutput("var stats", "wakeup interval changes");
+        }
+        requestedWakeupInterval = -1;
+    } else {
+        /* The request is rejected. An unconnected node stays unconnected and asks again
+         * with a later beacon; a connected node keeps its allocation and wakeup interval
+         * and may renegotiate again after wakeupAdaptationPeriod.
+         */
+        trace() << "Connection Request REJECTED, status code: " << assignment.statusCode;
+        connectionRequestAcked = false;
+        requestedWakeupInterval = -1;
+    }
+    // The request is answered, drop any copy still waiting for a retry
+    purgeManagement(CONNECTION_REQUEST);
+    if (!wasConnected && connectedHID != UNCONNECTED) {
+        collectOutput("Join", "time to connect (s)", SIMTIME_DBL(simTime()));
+        connectionRequestAcked = false;
+    }
+}
+
+/* Create a connection request for the hub that sent beacon. Used both to connect
+ * and, when connected, to renegotiate the wakeup interval and uplink slots.
+ */
+BaselineConnectionRequestPacket *BaselineBANMac::createConnectionRequest(BaselineBeaconPacket *beacon, int wakeupInterval, int uplinkRequest, int downlinkRequest) {
+    BaselineConnectionRequestPacket *connectionRequest = new BaselineConnectionRequestPacket("BaselineBAN connection request packet", MAC_LAYER_PACKET);
+
+    // This block takes care of general header fields
+    setHeaderFields(connectionRequest, I_ACK_POLICY, MANAGEMENT, CONNECTION_REQUEST);
+    // While setHeaderFields should take care of the HID field, we may be unconnected.
+    // We want to keep this state, yet send the request to the right hub.
+    connectionRequest->setHID(beacon->getHID());
+
+    // This block takes care of connection request specific fields
+    connectionRequest->setRecipientAddress(beacon->getSenderAddress());
+    connectionRequest->setSenderAddress(SELF_MAC_ADDRESS);
+    // In this implementation, our schedule always starts from the next beacon
+    connectionRequest->setNextWakeup(beacon->getSequenceNumber() + 1);
+    connectionRequest->setWakeupInterval(wakeupInterval);
+    // Uplink request is simplified in this implementation to only ask for a number of slots needed
+    connectionRequest->setUplinkRequest(uplinkRequest);
+    // Likewise the downlink request, the number of slots per wakeup the hub may transmit to us
+    connectionRequest->setDownlinkRequest(downlinkRequest);
+    connectionRequest->setByteLength(BASELINEBAN_CONNECTION_REQUEST_SIZE);
+    return connectionRequest;
+}
+
+/* Adaptive wakeup interval. From the packet arrival rate (smoothed over beacon
+ * wakeups) and the current TXBuffer backlog, pick the longest wakeup interval m
+ * (up to maxScheduledAccessPeriod) for which the traffic of m beacon periods fits
+ * in at most maxScheduledAccessLength slots, and ask for just enough slots for it.
+ * Quiet sensors end up sleeping across many beacons, bursting ones get more slots.
+ * A new request is only sent if the result changed and wakeupAdaptationPeriod
+ * beacon periods have passed since the last one.
+ */
+void BaselineBANMac::adaptWakeupInterval(BaselineBeaconPacket *beacon) {
+    simtime_t beaconPeriod = beaconPeriodLength * allocationSlotLength;
+    if (lastAdaptationTime >= 0) {
+        double periods = SIMTIME_DBL(getClock() - lastAdaptationTime) / SIMTIME_DBL(beaconPeriod);
+        if (periods > 0) {
+            double rate = arrivalsSinceAdaptation / periods;
+            arrivalsPerBeaconPeriod = (arrivalsPerBeaconPeriod < 0) ? rate : 0.7 * arrivalsPerBeaconPeriod + 0.3 * rate;
+        }
+    }
+    lastAdaptationTime = getClock();
+    arrivalsSinceAdaptation = 0;
+    beaconsSinceRenegotiation++;
+    // A request that ran out of retries unanswered is given up, allow a new one
+    if (requestedWakeupInterval > 0 && !isManagementPending(CONNECTION_REQUEST)) {
+        requestedWakeupInterval = -1;
+        beaconsSinceRenegotiation = wakeupAdaptationPeriod;
+    }
+    if (arrivalsPerBeaconPeriod < 0) return;
+    if (beaconsSinceRenegotiation * scheduledAccessPeriod < wakeupAdaptationPeriod) return;
+
+    // How many packets (with their I-ACK) fit in one allocation slot
+    double packetTime = SIMTIME_DBL(TX_TIME(avgDataPacketBytes > 0 ? avgDataPacketBytes : BASELINEBAN_HEADER_SIZE)
+            + TX_TIME(BASELINEBAN_HEADER_SIZE) + 2 * pTIFS);
+    int packetsPerSlot = max(1, (int)floor(SIMTIME_DBL(allocationSlotLength) / packetTime));
+
+    int bestInterval = 1;
+    int bestSlots = (int)ceil((arrivalsPerBeaconPeriod + TXBuffer.size()) / packetsPerSlot);
+    for (int m = 2; m <= maxScheduledAccessPeriod; m++) {
+        int slots = (int)ceil((arrivalsPerBeaconPeriod * m + TXBuffer.size()) / packetsPerSlot);
+        if (slots > maxScheduledAccessLength) break;
+        bestInterval = m;
+        bestSlots = slots;
+    }
+    bestSlots = min(max(bestSlots, 1), maxScheduledAccessLength);
+
+    int currentSlots = scheduledTxAccessEnd - scheduledTxAccessStart;
+    if (bestInterval == scheduledAccessPeriod && bestSlots == currentSlots) return;
+
+    trace() << "Adaptive wakeup: " << arrivalsPerBeaconPeriod << " pkts/beacon period, backlog " << TXBuffer.size()
+            << ", requesting interval " << bestInterval << " with " << bestSlots << " slots";
+    requestedWakeupInterval = bestInterval;
+    beaconsSinceRenegotiation = 0;
+    pushManagement(createConnectionRequest(beacon, bestInterval, bestSlots, downlinkAccessLength));
 }
 
-case CONNECTION_ASSIGNMENT: {
-    BaselineConnectionAssignmentPacket *connAssignment = check_and_cast<BaselineConnectionAssignmentPacket*>(BaselineBANPkt);
-    if (connAssignment->getStatusCode() == ACCEPTED || connAssignment->getStatusCode() == MODIFIED) {
-        connectedHID = connAssignment->getHID();
-        connectedNID = connAssignment->getAssignedNID();
-        // Set anew the header fields of the packet to be sent
-        if (packetToBeSent) {
-            packetToBeSent->setHID(connectedHID);
-            packetToBeSent->setNID(connectedNID);
-        }
-        // Set the start and end times for the schedule
-        scheduledTxAccessStart = connAssignment->getUplinkRequestStart();
-        scheduledTxAccessEnd = connAssignment->getUplinkRequestEnd();
-        trace() << "connected as NID " << connectedNID << "  --start TX access at slot: " << scheduledTxAccessStart << ", end at slot: " << scheduledTxAccessEnd;
-    } else {
-        // The connection request is rejected, handle it according to your requirements
-        trace() << "Connection Request REJECTED, status code: " << connAssignment->getStatusCode();
-        // TODO: Handle the rejected connection request, if needed
-    }
-    break;
+/* A function to calculate the extra guard time, if we are past the Sync time nominal.
+ */
+simtime_t BaselineBANMac::extraGuardTime() {
+	return (simtime_t) (getClock() - syncIntervalAdditionalStart) * estimatedClockDrift;
 }
 
-case DISCONNECTION: {
-    // Handle disconnection
-    connectedHID = UNCONNECTED;
-    connectedNID = UNCONNECTED;
-    // TODO: Handle any additional tasks or cleanups required upon disconnection
-    break;
+/* The guard needed when waking up for a beacon sleepLength from now: the normal
+ * GUARD_TIME, plus the drift accumulated over the part of the sleep that goes
+ * beyond the nominal sync interval (what extraGuardTime() would give at wakeup).
+ */
+simtime_t BaselineBANMac::beaconWakeupLead(simtime_t sleepLength) {
+	simtime_t lead = GUARD_TIME;
+	if (SInominal > 0 && sleepLength > SInominal)
+		lead += (sleepLength - SInominal) * estimatedClockDrift;
+	return lead;
 }
 
-case CONNECTION_REQUEST: {
-    BaselineConnectionRequestPacket *connRequest = check_and_cast<BaselineConnectionRequestPacket*>(BaselineBANPkt);
+// One beacon arrival used by the clock drift estimator
+struct DriftSample {
+    long index;         // beacon number, counted in nominal beacon periods
+    double arrival;     // local clock time the beacon frame started
+};
 
-    // Create the connection assignment packet
-    BaselineConnectionAssignmentPacket *connAssignment = new BaselineConnectionAssignmentPacket("BaselineBAN connection assignment", MAC_LAYER_PACKET);
-    setHeaderFields(connAssignment, I_ACK_POLICY, MANAGEMENT, CONNECTION_ASSIGNMENT);
+/* Estimate our clock drift from the arrival times of the last beacons. The hub
+ * sends a beacon every beaconPeriod of its own time, so arrival k (local time)
+ * should be t0 + k*beaconPeriod*(1+drift). A least squares line over the last
+ * driftEstimationBeacons arrivals gives the drift; its standard error, scaled by
+ * driftConfidence, is added as a safety margin. The result never exceeds the
+ * worst case mClockAccuracy, which is also used until enough beacons are seen.
+ */
+void BaselineBANMac::recordBeaconArrival(simtime_t arrival, simtime_t beaconPeriod) {
+	if (driftEstimationBeacons < 3) return;
+	// A new beacon period (or a lost sync) makes old samples useless
+	if (beaconPeriod != driftBeaconPeriod || (!driftSamples.empty() && arrival <= driftSamples.back().arrival)) {
+		driftSamples.clear();
+		driftBeaconPeriod = beaconPeriod;
+	}
+	DriftSample sample;
+	sample.arrival = SIMTIME_DBL(arrival);
+	sample.index = driftSamples.empty() ? 0 :
+		driftSamples.back().index + (long)round((sample.arrival - driftSamples.back().arrival) / SIMTIME_DBL(beaconPeriod));
+	driftSamples.push_back(sample);
+	if ((int)driftSamples.size() > driftEstimationBeacons) driftSamples.pop_front();
+
+	int n = driftSamples.size();
+	if (n < 3) {
+		estimatedClockDrift = mClockAccuracy;
+		return;
+	}
+	// Work relative to the oldest sample to keep the sums small
+	double x0 = driftSamples.front().index * SIMTIME_DBL(beaconPeriod), y0 = driftSamples.front().arrival;
+	double meanX = 0, meanY = 0;
+	for (int i = 0; i < n; i++) {
+		meanX += driftSamples[i].index * SIMTIME_DBL(beaconPeriod) - x0;
+		meanY += driftSamples[i].arrival - y0;
+	}
+	meanX /= n; meanY /= n;
+	double Sxx = 0, Sxy = 0;
+	for (int i = 0; i < n; i++) {
+		double dx = driftSamples[i].index * SIMTIME_DBL(beaconPeriod) - x0 - meanX;
+		Sxx += dx * dx;
+		Sxy += dx * (driftSamples[i].arrival - y0 - meanY);
+	}
+	if (Sxx <= 0) return;
+	double slope = Sxy / Sxx;
+	double residuals = 0;
+	for (int i = 0; i < n; i++) {
+		double x = driftSamples[i].index * SIMTIME_DBL(beaconPeriod) - x0;
+		double r = driftSamples[i].arrival - y0 - (meanY + slope * (x - meanX));
+		residuals += r * r;
+	}
+	double slopeError = sqrt(residuals / (n - 2) / Sxx);
+	double drift = fabs(slope - 1.0) + driftConfidence * slopeError;
+	// Keep a small floor so that SInominal stays finite
+	estimatedClockDrift = min((double)mClockAccuracy, max(drift, mClockAccuracy / 100.0));
+	driftEstimateVector.record(estimatedClockDrift * 1e6);
+}
 
-    // Get the full ID of the requesting node
-    int fullAddress = connRequest->getSenderAddress();
+/* The superframe plan replaces the individual sensor timers (sync interval, setup,
+ * sleeping, scheduled/posted access, beacon wakeup) with one ordered list of
+ * (time, action) entries driven by the single SUPERFRAME_PLAN timer.
+ * planAction() and cancelPlannedAction() keep the semantics of setTimer() and
+ * cancelTimer(): an action is pending at most once, and planning it again moves it.
+ * The real timer is only touched when the earliest entry changes.
+ */
+struct SuperframePlanEntry {
+    simtime_t time;     // local clock time at which the action is due
+    int action;         // timer index handled by timerFiredCallback()
+};
 
-    // Check if the request is on an already active assignment
-    map<int, slotAssign_t>::iterator iter = slotAssignmentMap.find(fullAddress);
-    if (iter != slotAssignmentMap.end()) {
-        // The request has been processed *successfully* before, assign old resources
-        connAssignment->setStatusCode(ACCEPTED);
-        connAssignment->setAssignedNID(iter->second.NID);
-        connAssignment->setUplinkRequestStart(iter->second.startSlot);
-        connAssignment->setUplinkRequestEnd(iter->second.endSlot);
-        trace() << "Connection request seen before! Assigning stored NID and resources...";
-        trace() << "Connection request from NID " << connRequest->getNID() << " (full addr: " << fullAddress << ") Assigning connected NID " << iter->second.NID;
-    } else {
-        // The request has not been processed before, try to assign new resources
-        if (connRequest->getUplinkRequest() > beaconPeriodLength - (currentFirstFreeSlot - 1)) {
-            connAssignment->setStatusCode(REJ_NO_RESOURCES);
-            // Can not accommodate the request, no available resources
-        } else if (currentFreeConnectedNID > 239) {
-            connAssignment->setStatusCode(REJ_NO_NID);
-            // No available NIDs for new connections
-        } else {
-            // Update the slotAssignmentMap with the new assignment
-            slotAssign_t newAssignment;
-            newAssignment.NID = currentFreeConnectedNID;
-            newAssignment.startSlot = currentFirstFreeSlot;
-            newAssignment.endSlot = currentFirstFreeSlot + connRequest->getUplinkRequest();
-            slotAssignmentMap[fullAddress] = newAssignment;
+void BaselineBANMac::planAction(int action, simtime_t delay) {
+    if (delay < 0) delay = 0;
+    simtime_t due = getClock() + delay;
+    removePlannedAction(action);
+    vector<SuperframePlanEntry>::iterator iter = superframePlan.begin();
+    // Entries due at the same time keep the order they were planned in
+    while (iter != superframePlan.end() && iter->time <= due) iter++;
+    SuperframePlanEntry entry;
+    entry.time = due;
+    entry.action = action;
+    superframePlan.insert(iter, entry);
+    armSuperframePlan();
+}
 
-            // Construct the rest of the connection assignment packet
-            connAssignment->setStatusCode(ACCEPTED);
-            connAssignment->setAssignedNID(newAssignment.NID);
-            connAssignment->setUplinkRequestStart(newAssignment.startSlot);
-            connAssignment->setUplinkRequestEnd(newAssignment.endSlot);
-            trace() << "Connection request from NID " << connRequest->getNID() << " (full addr: " << fullAddress << ") Assigning connected NID " << newAssignment.NID;
+void BaselineBANMac::cancelPlannedAction(int action) {
+    if (removePlannedAction(action)) armSuperframePlan();
+}
 
-            // Update hub's lastTxAccessSlot and currentFreeConnectedNID
-            lastTxAccessSlot[currentFreeConnectedNID].scheduled = newAssignment.endSlot - 1;
-            currentFirstFreeSlot += connRequest->getUplinkRequest();
-            currentFreeConnectedNID++;
+bool BaselineBANMac::removePlannedAction(int action) {
+    for (vector<SuperframePlanEntry>::iterator iter = superframePlan.begin(); iter != superframePlan.end(); iter++) {
+        if (iter->action == action) {
+            superframePlan.erase(iter);
+            return true;
         }
     }
-
-    // Push the connection assignment packet to the Management packets buffer
-    MgmtBuffer.push(connAssignment);
-
-    // Transmission will be attempted after we are done sending the I-ACK
-    trace() << "Connection assignment created, wait for " << (TX_TIME(BASELINEBAN_HEADER_SIZE) + 2 * pTIFS) << " to attemptTX";
-    break;
+    return false;
 }
 
-case T_POLL:
-    // Just read the time values from the payload, update relevant variables, and roll over to handle the POLL part (no break)
-case POLL: {
-    handlePoll(BaselineBANPkt);
-    break;
+void BaselineBANMac::beginSuperframePlan() {
+    superframePlanBatch = true;
 }
 
-case ASSOCIATION:
-case DISASSOCIATION:
-case PTK:
-case GTK: {
-    trace() << "WARNING: unimplemented packet subtype in [" << BaselineBANPkt->getName() << "]";
-    // Handle unimplemented packet subtype according to your requirements
-    break;
+void BaselineBANMac::commitSuperframePlan() {
+    superframePlanBatch = false;
+    armSuperframePlan();
 }
 
+void BaselineBANMac::armSuperframePlan() {
+    // While compiling or running the plan, arming is done once at the end
+    if (superframePlanBatch) return;
+    if (superframePlan.empty()) {
+        if (superframePlanArmedAt >= 0) cancelTimer(SUPERFRAME_PLAN);
+        superframePlanArmedAt = -1;
+        return;
+    }
+    simtime_t due = superframePlan.front().time;
+    if (due == superframePlanArmedAt) return;
+    superframePlanArmedAt = due;
+    setTimer(SUPERFRAME_PLAN, due > getClock() ? due - getClock() : 0);
+    collectOutput("var stats", "plan timer rearms");
+}
 
+void BaselineBANMac::runSuperframePlan() {
+    superframePlanArmedAt = -1;
+    superframePlanBatch = true;
+    // Run every action that is due. Handlers may plan new actions, which are
+    // inserted in order and run here too if they are already due.
+    while (!superframePlan.empty() && superframePlan.front().time <= getClock()) {
+        int action = superframePlan.front().action;
+        superframePlan.erase(superframePlan.begin());
+        timerFiredCallback(action);
+    }
+    commitSuperframePlan();
+}
 
+/* Radio energy accounting. Every change of macState or of the commanded radio
+ * state closes the current interval and charges it to the macState it was spent
+ * in, at the power of the radio state. Waking the radio up additionally costs
+ * pTimeSleepToTX at RX power.
+ */
+void BaselineBANMac::setMacState(MacStates_type newState) {
+    if (newState == macState) return;
+    accountRadioEnergy();
+    macState = newState;
 }
 
+void BaselineBANMac::setRadioState(BasicState_type newState) {
+    // Commands that would not change what the radio is doing are not sent at all
+    if (newState == effectiveRadioState()) {
+        radioCommandsSuppressed++;
+        return;
+    }
+    accountRadioEnergy();
+    if (radioState == SLEEP && newState != SLEEP)
+        radioEnergyByMacState[macState] += pTimeSleepToTX * radioRxPower;
+    radioState = newState;
+    isRadioSleeping = (newState == SLEEP);
+    radioCommandsIssued++;
+    toRadioLayer(createRadioCommand(SET_STATE, newState));
+}
 
-/* The specific finish function for BaselineBANMAC does needed cleanup when simulation ends
+/* Send a packet to the radio and make sure it is transmitted. The radio sends
+ * everything in its buffer before leaving TX, so while a transmission is still
+ * in progress a new packet rides on it and no extra SET_STATE TX is needed.
+ * radioTxBusyUntil tracks when the radio is done, including the wakeup time.
  */
-void BaselineBANMac::finishSpecific(){
-	if (packetToBeSent != NULL) cancelAndDelete(packetToBeSent);
-	while(!MgmtBuffer.empty()) {
-		cancelAndDelete(MgmtBuffer.front());
-		MgmtBuffer.pop();
+void BaselineBANMac::transmitToRadio(cPacket *pkt) {
+    simtime_t txTime = TX_TIME(pkt->getByteLength());
+    BaselineMacPacket *macPkt = dynamic_cast<BaselineMacPacket*>(pkt);
+    // Data sent in our scheduled or polled access, contention access has no allocated slots to use
+    if (!isHub && macPkt != NULL && macPkt->getFrameType() == DATA && macState == MAC_FREE_TX_ACCESS)
+        markSlotUsed((int)round(SIMTIME_DBL(getClock() - frameStartTime) / allocationSlotLength) + 1);
+    if (radioState == TX && getClock() < radioTxBusyUntil) {
+        toRadioLayer(pkt);
+        radioTxBusyUntil += txTime;
+        txCommandsCoalesced++;
+        return;
     }
-    if (isHub) {delete[] reqToSendMoreData; delete[] lastTxAccessSlot;}
+    simtime_t txStart = getClock() + (radioState == SLEEP ? pTimeSleepToTX : 0);
+    toRadioLayer(pkt);
+    /* setRadioState() only suppresses TX while effectiveRadioState() is TX, which is the
+     * case handled above, so the TX command following a packet is never dropped here.
+     */
+    setRadioState(TX);
+    radioTxBusyUntil = txStart + txTime;
 }
 
-bool BaselineBANMac::isPacketForMe(BaselineMacPacket *pkt) {
-    int pktUP = pkt->getUserPriority(); // Assuming you have a method to retrieve the User Priority from the packet
-    int pktNID = pkt->getNID(); // Assuming you have a method to retrieve the Node ID from the packet
+// After a transmission the radio returns to RX by itself
+BasicState_type BaselineBANMac::effectiveRadioState() {
+    if (radioState == TX && getClock() >= radioTxBusyUntil) return RX;
+    return radioState;
+}
 
-    // Check if the packet is addressed to the hub (User Priority 7)
-    if (pktUP == UP7) {
-        if (isHub) return true; // The hub can receive packets with UP7
-        return false; // Sensors cannot receive UP7 packets
+void BaselineBANMac::accountRadioEnergy() {
+    simtime_t now = getClock();
+    if (radioState == TX && radioTxBusyUntil < now) {
+        // Close the TX part, the rest of the interval was spent in RX
+        if (radioTxBusyUntil > radioAccountingStart) {
+            chargeRadioInterval(SIMTIME_DBL(radioTxBusyUntil - radioAccountingStart), TX);
+            radioAccountingStart = radioTxBusyUntil;
+        }
+        radioState = RX;
     }
+    chargeRadioInterval(SIMTIME_DBL(now - radioAccountingStart), radioState);
+    radioAccountingStart = now;
+}
 
-    // Check if the packet is addressed to the sensors (User Priority 6, 5, 4, 3, 2, 1, or 0)
-    if (pktUP >= UP0 && pktUP <= UP6) {
-        // Check if the packet is a broadcast packet
-        if (pktNID == BROADCAST_NID) {
-            if (isHub) return true; // The hub can receive broadcast packets
-            return false; // Sensors cannot receive broadcast packets
-        }
+void BaselineBANMac::chargeRadioInterval(double elapsed, BasicState_type state) {
+    if (elapsed <= 0) return;
+    double power = (state == TX ? radioTxPower : (state == RX ? radioRxPower : radioSleepPower));
+    radioEnergyByMacState[macState] += elapsed * power;
+    if (state != SLEEP) radioOnTimeByMacState[macState] += elapsed;
+}
 
-        // Check if the packet is addressed to the hub
-        if (pktNID == connectedNID) {
-            if (isHub) return true; // The hub can receive packets addressed to itself
-            return false; // Sensors cannot receive packets addressed to the hub
-        }
+/* Only put the radio to sleep if the idle gap is longer than the break-even time,
+ * otherwise the sleep and wakeup transitions cost more than idle listening.
+ * A negative gap means that no wakeup is known, so sleeping always pays off.
+ */
+void BaselineBANMac::sleepRadioIfWorthIt(simtime_t idleGap) {
+    if (idleGap >= 0 && idleGap <= breakEvenSleepTime) {
+        trace() << "Idle gap " << idleGap << " below break-even " << breakEvenSleepTime << ", radio stays on";
+        collectOutput("var stats", "sleeps skipped (below break-even)");
+        return;
+    }
+    setRadioState(SLEEP);
+}
 
-        // Check if the packet is addressed to any of the sensors (single-hop communication)
-        if (!isHub && pktNID >= 1 && pktNID <= 5) {
-            return true;
-        }
+// Time until the next planned action that turns the radio back on, -1 if none is planned
+simtime_t BaselineBANMac::timeToNextWakeup() {
+    for (vector<SuperframePlanEntry>::iterator iter = superframePlan.begin(); iter != superframePlan.end(); iter++) {
+        if (iter->action == WAKEUP_FOR_BEACON || iter->action == START_SCHEDULED_TX_ACCESS ||
+                iter->action == START_SCHEDULED_RX_ACCESS || iter->action == START_POSTED_ACCESS)
+            return iter->time - getClock();
     }
+    return -1;
+}
 
-    // For all other cases, the packet is not for this node
-    return false;
+const char *BaselineBANMac::macStateName(int state) {
+    switch (state) {
+        case MAC_SETUP: return "setup";
+        case MAC_RAP: return "RAP";
+        case MAC_EAP: return "EAP";
+        case MAC_CAP: return "CAP";
+        case MAC_FREE_TX_ACCESS: return "free TX access";
+        case MAC_FREE_RX_ACCESS: return "free RX access";
+        case MAC_BEACON_WAIT: return "beacon wait";
+        case MAC_SLEEP: return "sleep";
+    }
+    return "other";
+}
+
+/* Beacon shifting sequences for coexistence of neighbouring BANs. A shifting hub
+ * moves its whole superframe by sequence[phase] * beaconShiftOffset slots in the
+ * beacon period of the given phase (the phase advances by one every beacon, mod
+ * beaconShiftingPhases). Different sequences make two BANs that overlap in one
+ * period fall apart in the next ones.
+ */
+static const int beaconShiftingPhases = 4;
+static const int beaconShiftingSequences[][beaconShiftingPhases] = {
+    {0, 1, 2, 3},
+    {1, 3, 0, 2},
+    {2, 0, 3, 1},
+    {3, 2, 1, 0},
+    {0, 2, 1, 3},
+    {1, 0, 3, 2},
+    {2, 3, 0, 1},
+    {3, 1, 2, 0},
+};
+static const int numBeaconShiftingSequences = sizeof(beaconShiftingSequences) / sizeof(beaconShiftingSequences[0]);
+
+// Offset of the beacon of the given phase from its nominal time, 0 if not shifting
+simtime_t BaselineBANMac::beaconShift(int shiftIndex, int phase) {
+    if (shiftIndex < 0 || shiftIndex >= numBeaconShiftingSequences) return 0;
+    return beaconShiftingSequences[shiftIndex][phase % beaconShiftingPhases] * beaconShiftOffset * allocationSlotLength;
 }
 
+// How much the beacon periodsAhead periods after the one of the given phase moves, compared to this one
+simtime_t BaselineBANMac::beaconShiftDelta(int shiftIndex, int phase, int periodsAhead) {
+    return beaconShift(shiftIndex, phase + periodsAhead) - beaconShift(shiftIndex, phase);
+}
 
-/* A function to calculate the extra guard time, if we are past the Sync time nominal.
+/* A beacon from another hub was heard while we listen in our own superframe,
+ * so the two BANs overlap. Start beacon shifting with a sequence different from
+ * the one of that hub (our address spreads the choice among many hubs).
  */
-simtime_t BaselineBANMac::extraGuardTime() {
-	return (simtime_t) (getClock() - syncIntervalAdditionalStart) * mClockAccuracy;
+void BaselineBANMac::handleForeignBeacon(BaselineBeaconPacket *beacon) {
+    collectOutput("var stats", "foreign beacons heard");
+    if (!enableCoexistence) return;
+    int foreignIndex = beacon->getBeaconShiftingSequenceIndex();
+    if (beaconShiftIndex >= 0 && beaconShiftIndex != foreignIndex) return;
+
+    int newIndex = (SELF_MAC_ADDRESS + beacon->getHID() + (beaconShiftIndex + 1)) % numBeaconShiftingSequences;
+    if (newIndex == foreignIndex) newIndex = (newIndex + 1) % numBeaconShiftingSequences;
+    trace() << "Beacon of HID " << beacon->getHID() << " heard (shifting sequence " << foreignIndex
+            << "), using beacon shifting sequence " << newIndex;
+
+    // The current superframe keeps its offset, the next beacon moves to the offset of the new sequence
+    int currentPhase = (beaconShiftPhase + beaconShiftingPhases - 1) % beaconShiftingPhases;
+    simtime_t nextNominalBeacon = frameStartTime - beaconShift(beaconShiftIndex, currentPhase) + beaconPeriodLength * allocationSlotLength;
+    beaconShiftIndex = newIndex;
+    setTimer(SEND_BEACON, nextNominalBeacon + beaconShift(beaconShiftIndex, beaconShiftPhase) - getClock());
+    collectOutput("var stats", "beacon shifting sequence changes");
+}
+
+// Number of beacon periods after which the hopping sequence repeats
+int BaselineBANMac::hopCycleLength() {
+    return beaconHopDwell * hopFrequencies.size();
+}
+
+// Tune the radio to the channel of the given hopping state, unless it is already there
+void BaselineBANMac::tuneToHopState(int hopState) {
+    double frequency = hopFrequencies[(hopState / beaconHopDwell) % hopFrequencies.size()];
+    if (frequency == currentCarrierFrequency) return;
+    trace() << "Channel hop to " << frequency << " MHz (hopping state " << hopState << ")";
+    toRadioLayer(createRadioCommand(SET_CARRIER_FREQ, frequency));
+    currentCarrierFrequency = frequency;
+    collectOutput("var stats", "channel hops");
 }
 
 void BaselineBANMac::setHeaderFields(BaselineMacPacket *pkt, AcknowledgementPolicy_type ackPolicy, Frame_type frameType, Frame_subtype frameSubtype, int userPriority) {
     pkt->setHID(connectedHID);
-    if (connectedNID != UNCONNECTED)
+    if (isHub && frameType == DATA) {
+        // Hub data keeps the NID of its recipient, set when it was queued
+    } else if (connectedNID != UNCONNECTED)
         pkt->setNID(connectedNID);
     else
         pkt->setNID(unconnectedNID);
@@ -977,9 +3294,9 @@ void BaselineBANMac::setHeaderFields(BaselineMacPacket *pkt, AcknowledgementPoli
                 pkt->setMoreData(1);
         }
     } else if (frameType == DATA && isHub) {
-        // Hubs need to handle their moreData flag (signaling posts) separately
-        // Set the appropriate moreData value for the hub (e.g., based on its buffers)
-        pkt->setMoreData(...); // Replace ... with the actual logic to set moreData for the hub
+        // Hubs signal what is left in the recipient's downlink queue, the recipient stays awake for it
+        int pending = downlinkPending(pkt->getNID());
+        pkt->setMoreData(enhanceMoreData ? pending : min(pending, 1));
     } else {
         // For non-DATA packets, set moreData to 0
         pkt->setMoreData(0);
@@ -988,7 +3305,7 @@ void BaselineBANMac::setHeaderFields(BaselineMacPacket *pkt, AcknowledgementPoli
 
 void BaselineBANMac::attemptTX() {
     // If we are not in an appropriate state, return
-    if (macState != MAC_RAP && macState != MAC_FREE_TX_ACCESS) return;
+    if (macState != MAC_RAP && macState != MAC_CAP && macState != MAC_FREE_TX_ACCESS) return;
     /* if we are currently attempting to TX or we have scheduled a future
      * attempt to TX, or waiting for an ack, return
      */
@@ -996,35 +3313,57 @@ void BaselineBANMac::attemptTX() {
 
     // Check if there's a packet to be sent and if it has exceeded the maximum packet tries
     if (packetToBeSent && currentPacketTransmissions + currentPacketCSFails < maxPacketTries) {
-        if (macState == MAC_RAP && (enableRAP || packetToBeSent->getFrameType() != DATA))
-            attemptTxInRAP();
-        if (macState == MAC_FREE_TX_ACCESS && canFitTx())
+        if ((macState == MAC_RAP || macState == MAC_CAP) && (enableRAP || packetToBeSent->getFrameType() != DATA))
+            attemptContention();
+        if (macState == MAC_FREE_TX_ACCESS && (canFitTx() || selectGapFillPacket()))
             sendPacket();
         return;
     }
 
+    // A management frame with retry budget left gets another round in the next beacon period
+    if (packetToBeSent && packetToBeSent->getFrameType() != DATA && parkManagementForRetry(packetToBeSent)) {
+        packetToBeSent = NULL;
+        currentPacketTransmissions = 0;
+        currentPacketCSFails = 0;
+    }
+
     // If there is still a packet in the buffer after max tries, delete it, reset relevant variables, and collect stats
     if (packetToBeSent) {
         trace() << "Max TX attempts reached. Last attempt was a CS fail";
         if (currentPacketCSFails == maxPacketTries) {
             if (packetToBeSent->getFrameType() == DATA)
-                collectOutput("Data pkt breakdown", "Failed, Channel busy");
+                collectDataOutcome(packetToBeSent, "Failed, Channel busy");
             else
                 collectOutput("Mgmt & Ctrl pkt breakdown", "Failed, Channel busy");
         } else {
             if (packetToBeSent->getFrameType() == DATA)
-                collectOutput("Data pkt breakdown", "Failed, No Ack");
+                collectDataOutcome(packetToBeSent, "Failed, No Ack");
             else
                 collectOutput("Mgmt & Ctrl pkt breakdown", "Failed, No Ack");
         }
+        if (packetToBeSent->getFrameType() == DATA) recordLatency(packetToBeSent, LATENCY_DROPPED, currentAccessMode());
+        managementRoundsLeft.erase(packetToBeSent);
         cancelAndDelete(packetToBeSent);
         packetToBeSent = NULL;
         currentPacketTransmissions = 0;
         currentPacketCSFails = 0;
     }
 
+    // A packet parked by selectGapFillPacket() goes first, with its TX counters restored
+    if (deferredPacket != NULL) {
+        packetToBeSent = deferredPacket;
+        currentPacketTransmissions = deferredPacketTransmissions;
+        currentPacketCSFails = deferredPacketCSFails;
+        deferredPacket = NULL;
+    }
+    // In a downlink run, draw from the queue of the node the run belongs to
+    else if (isHub && macState == MAC_FREE_TX_ACCESS && nextDownlinkPacket() != NULL) {
+        packetToBeSent = nextDownlinkPacket();
+        downlinkQueues[packetToBeSent->getNID()].pop();
+        setHeaderFields(packetToBeSent, I_ACK_POLICY, DATA, RESERVED, LOW_TRAFFIC_PRIORITY);
+    }
     // Try to draw a new packet from the Management buffer based on traffic priority
-    if (!MgmtBuffer.empty()) {
+    else if (!MgmtBuffer.empty()) {
         BaselineMacPacket* nextPacket = (BaselineMacPacket*)MgmtBuffer.front();
         int userPriority = nextPacket->getUserPriority();
         if (userPriority == HIGH_TRAFFIC_PRIORITY) {
@@ -1046,26 +3385,31 @@ void BaselineBANMac::attemptTX() {
         }
     } else if (connectedNID != UNCONNECTED && !TXBuffer.empty()) {
         // If there are no packets in the Management buffer, draw a packet from the Data buffer
-        packetToBeSent = (BaselineMacPacket*)TXBuffer.front();
-        TXBuffer.pop();
+        packetToBeSent = popTXBuffer();
         setHeaderFields(packetToBeSent, I_ACK_POLICY, DATA, RESERVED, LOW_TRAFFIC_PRIORITY);
     }
 
+    sampleQueues();
+
     // If we found a packet in any of the buffers, try to TX it
     if (packetToBeSent) {
-        if (macState == MAC_RAP && (enableRAP || packetToBeSent->getFrameType() != DATA))
-            attemptTxInRAP();
-        if (macState == MAC_FREE_TX_ACCESS && canFitTx())
+        if ((macState == MAC_RAP || macState == MAC_CAP) && (enableRAP || packetToBeSent->getFrameType() != DATA))
+            attemptContention();
+        if (macState == MAC_FREE_TX_ACCESS && (canFitTx() || selectGapFillPacket()))
             sendPacket();
     }
 }
 
 
 bool BaselineBANMac::canFitTx() {
-    if (!packetToBeSent) return false;
+    return canFitTx(packetToBeSent);
+}
 
-    // Calculate the transmission time for the current packet
-    double txTime = TX_TIME(packetToBeSent->getByteLength()) + pTIFS;
+bool BaselineBANMac::canFitTx(BaselineMacPacket *pkt) {
+    if (!pkt) return false;
+
+    // Calculate the transmission time for the given packet
+    double txTime = TX_TIME(pkt->getByteLength()) + pTIFS;
 
     // Check if the transmission can fit in EAP superframe
     if (macState == MAC_EAP) {
@@ -1082,16 +3426,68 @@ bool BaselineBANMac::canFitTx() {
         if (endTime - getClock() - (GUARD_FACTOR * GUARD_TIME) - txTime > 0)
             return true;
     }
+    // Check if the transmission can fit in a scheduled or polled access
+    else if (macState == MAC_FREE_TX_ACCESS) {
+        if (endTime - getClock() - (GUARD_FACTOR * GUARD_TIME) - txTime > 0)
+            return true;
+    }
 
     return false;
 }
 
-// Define the superframe periods and their durations
-enum SuperframePeriod {
-    EAP_PERIOD, // TDMA period for P1 (UP=7) packets (Emergency category)
-    RAP_PERIOD, // CSMA/CA period for P2 (UP4, UP5, UP6) packets (Dependent category)
-    CAP_PERIOD, // CSMA/CA period for P3 (UP0, UP1, UP2, UP3) packets (Independent category)
-};
+/* When packetToBeSent does not fit in what is left of the current access period,
+ * look ahead in TXBuffer for a smaller data packet that does. Only the oldest
+ * queued packet of each user priority is a candidate, so packets of the same
+ * flow are never reordered. Among the candidates that fit, the highest user
+ * priority wins. The packet that did not fit is parked in deferredPacket (with
+ * its TX counters) and is drawn again by attemptTX() before anything else.
+ * Returns true if packetToBeSent was replaced by a packet that fits.
+ */
+bool BaselineBANMac::selectGapFillPacket() {
+    if (!packetToBeSent || deferredPacket != NULL) return false;
+    if (connectedNID == UNCONNECTED || TXBuffer.empty()) return false;
+
+    int queued = TXBuffer.size();
+    bool seenUP[8] = {false, false, false, false, false, false, false, false};
+    int chosenIndex = -1;
+    int chosenUP = -1;
+    for (int i = 0; i < queued; i++) {
+        BaselineMacPacket *pkt = (BaselineMacPacket*)TXBuffer.front();
+        TXBuffer.pop();
+        TXBuffer.push(pkt);
+        int up = pkt->getPriority();
+        if (up < 0 || up > 7 || seenUP[up]) continue;
+        seenUP[up] = true;
+        if (up > chosenUP && canFitTx(pkt)) {
+            chosenIndex = i;
+            chosenUP = up;
+        }
+    }
+    if (chosenIndex < 0) return false;
+
+    // Rotate the buffer once more, taking out the chosen packet and keeping the order of the rest
+    BaselineMacPacket *gapFillPacket = NULL;
+    for (int i = 0; i < queued; i++) {
+        BaselineMacPacket *pkt = (BaselineMacPacket*)TXBuffer.front();
+        TXBuffer.pop();
+        if (i == chosenIndex) gapFillPacket = pkt;
+        else TXBuffer.push(pkt);
+    }
+    accountTXBuffer(gapFillPacket, -1);
+
+    trace() << "Packet " << packetToBeSent->getName() << " does not fit, gap-filling with UP" << chosenUP
+            << " packet (" << gapFillPacket->getByteLength() << " bytes)";
+    deferredPacket = packetToBeSent;
+    deferredPacketTransmissions = currentPacketTransmissions;
+    deferredPacketCSFails = currentPacketCSFails;
+
+    packetToBeSent = gapFillPacket;
+    setHeaderFields(packetToBeSent, I_ACK_POLICY, DATA, RESERVED, LOW_TRAFFIC_PRIORITY);
+    currentPacketTransmissions = 0;
+    currentPacketCSFails = 0;
+    collectOutput("var stats", "gap-filled TX");
+    return true;
+}
 
 // Define the priority levels
 enum PriorityLevel {
@@ -1100,57 +3496,55 @@ enum PriorityLevel {
     PRIORITY_P3, // Low priority (UP0, UP1, UP2, UP3)
 };
 
-// Function to determine the current superframe period
-SuperframePeriod getCurrentSuperframePeriod() {
-    // Implement your logic to determine the current superframe period based on time or other factors
-    // This function can use timers or other mechanisms to switch between periods
-    // For simplicity, let's assume a static period schedule:
-    // EAP_PERIOD for the first 5 seconds, RAP_PERIOD for the next 5 seconds, and then CAP_PERIOD.
-    if (getCurrentTime() < 5) {
-        return EAP_PERIOD;
-    } else if (getCurrentTime() < 10) {
-        return RAP_PERIOD;
-    } else {
-        return CAP_PERIOD;
-    }
+/* Phase engine. The phase of a slot follows from the boundaries advertised in the
+ * beacon, so it is found in O(1) from the slot index, at the hub (currentSlot) and
+ * at sensors (slot derived from the clock and the start of the superframe).
+ */
+SuperframePeriod BaselineBANMac::phaseOfSlot(int slot) {
+    if (slot <= EAP1Length) return EAP_PERIOD;
+    if (slot <= RAP1Length) return RAP_PERIOD;
+    if (CAPStart > 0 && slot >= CAPStart) return CAP_PERIOD;
+    return MANAGED_PERIOD;
 }
 
-// Function to check if the current time falls within the superframe period
-bool isWithinSuperframePeriod(SuperframePeriod period) {
-    // Implement your logic to check if the current time is within the specified superframe period
-    // For simplicity, let's assume that the superframe periods are of fixed duration.
-    // In practice, you may use timers or other mechanisms to track the superframe periods.
-    return (getCurrentTime() >= 0 && getCurrentTime() < 5) && period == EAP_PERIOD ||
-           (getCurrentTime() >= 5 && getCurrentTime() < 10) && period == RAP_PERIOD ||
-           (getCurrentTime() >= 10) && period == CAP_PERIOD;
+int BaselineBANMac::slotAtClock() {
+    if (isHub) return currentSlot;
+    return (int)floor(SIMTIME_DBL(getClock() - frameStartTime) / allocationSlotLength) + 1;
 }
 
-// Function to send a packet based on the current superframe period and priority level
-void sendPacket() {
-    SuperframePeriod currentPeriod = getCurrentSuperframePeriod();
+SuperframePeriod BaselineBANMac::getCurrentSuperframePeriod() {
+    return phaseOfSlot(slotAtClock());
+}
 
-    // Determine the priority level of the packet (P1, P2, P3) based on its UP (User Priority) and traffic category
-    PriorityLevel packetPriority = determinePacketPriority(); // Implement your logic here
+bool BaselineBANMac::isWithinSuperframePeriod(SuperframePeriod period) {
+    return getCurrentSuperframePeriod() == period;
+}
 
-    if (currentPeriod == EAP_PERIOD) {
-        // During EAP period, use TDMA to send high-priority packets (P1)
-        if (packetPriority == PRIORITY_P1) {
-            // Use TDMA to schedule packet transmission for P1 (UP=7) packets (Emergency category)
-            // Wait for the TDMA slot and send the packet
-            sendUsingTDMA();
-        }
-    } else if (currentPeriod == RAP_PERIOD) {
-        // During RAP period, use CSMA/CA to send medium-priority packets (P2)
-        if (packetPriority == PRIORITY_P2) {
-            // Use CSMA/CA to contend for the channel and send the packet
-            sendUsingCSMACA();
-        }
-    } else if (currentPeriod == CAP_PERIOD) {
-        // During CAP period, use CSMA/CA to send low-priority packets (P3)
-        if (packetPriority == PRIORITY_P3) {
-            // Use CSMA/CA to contend for the channel and send the packet
-            sendUsingCSMACA();
-        }
+/* Contention access per phase: EAP1 is exclusive to emergency (UP7) data, RAP1
+ * and CAP are open to every user priority and to management frames. Scheduled,
+ * polled and posted slots are never contended for.
+ */
+bool BaselineBANMac::mayContend(BaselineMacPacket *pkt) {
+    switch (getCurrentSuperframePeriod()) {
+        case EAP_PERIOD: return pkt->getFrameType() == DATA && pkt->getPriority() == 7;
+        case RAP_PERIOD:
+        case CAP_PERIOD: return true;
+        default: return false;
+    }
+}
+
+/* Contend for packetToBeSent if the current phase admits it. Otherwise try again
+ * when RAP1 starts (a packet held back by EAP1); CAP is reached through START_CAP.
+ */
+void BaselineBANMac::attemptContention() {
+    if (mayContend(packetToBeSent)) {
+        attemptTxInRAP();
+        return;
+    }
+    if (getCurrentSuperframePeriod() == EAP_PERIOD && EAP1Length < RAP1Length) {
+        setTimer(START_ATTEMPT_TX, max(frameStartTime + EAP1Length * allocationSlotLength - getClock(), SIMTIME_ZERO));
+        futureAttemptToTX = true;
+        trace() << "EAP1 is for emergency traffic, attempt TX when RAP1 starts";
     }
 }
 
@@ -1187,8 +3581,7 @@ void sendUsingCSMACA(BaselineMacPacket *pkt) {
 
     if (isChannelIdle()) {
         // Channel is idle, send the packet
-        toRadioLayer(pkt);
-        toRadioLayer(createRadioCommand(SET_STATE, TX));
+        transmitToRadio(pkt);
     } else {
         // Channel is busy, back off for a random period and retry
         double backoffTime = calculateRandomBackoff();
@@ -1217,7 +3610,7 @@ double calculateRandomBackoff() {
 void BaselineBANMac::handlePoll(BaselineMacPacket *pkt) {
     // check if this is an immediate (not future) poll
     if (pkt->getMoreData() == 0) {
-        macState = MAC_FREE_TX_ACCESS;
+        setMacState(MAC_FREE_TX_ACCESS);
         trace() << "State from " << macState << " to MAC_FREE_TX_ACCESS (poll)";
         isPollPeriod = true;
         int endPolledAccessSlot = pkt->getSequenceNumber();
@@ -1231,9 +3624,9 @@ void BaselineBANMac::handlePoll(BaselineMacPacket *pkt) {
         // reset the timer for sleeping as needed
         if (endPolledAccessSlot != beaconPeriodLength &&
             (endPolledAccessSlot + 1) != scheduledTxAccessStart && (endPolledAccessSlot + 1) != scheduledRxAccessStart) {
-            setTimer(START_SLEEPING, endTime - getClock());
+            planAction(START_SLEEPING, endTime - getClock());
         } else {
-            cancelTimer(START_SLEEPING);
+            cancelPlannedAction(START_SLEEPING);
         }
 
         int currentSlotEstimate = round(SIMTIME_DBL(getClock() - frameStartTime) / allocationSlotLength) + 1;
@@ -1252,9 +3645,9 @@ void BaselineBANMac::handlePoll(BaselineMacPacket *pkt) {
         trace() << "Future Poll received, postSlot= " << postedAccessStart << " waking up in " << postTime - GUARD_TIME - getClock();
         // if the post is the slot immediately after, then we have to check if we get a negative number for the timer
         if (postTime <= getClock() - GUARD_TIME) {
-            setTimer(START_POSTED_ACCESS, 0);
+            planAction(START_POSTED_ACCESS, 0);
         } else {
-            setTimer(START_POSTED_ACCESS, postTime - GUARD_TIME - getClock());
+            planAction(START_POSTED_ACCESS, postTime - GUARD_TIME - getClock());
         }
     }
 }
@@ -1274,7 +3667,7 @@ void BaselineBANMac::handlePost(BaselineMacPacket *pkt) {
     // Post lasts for the current slot. This can be problematic, since we might go to sleep
     // while receiving. We need a post timeout.
     postedAccessEnd = postedAccessStart + 1;
-    setTimer(START_POSTED_ACCESS, 0);
+    planAction(START_POSTED_ACCESS, 0);
 }
 
 
@@ -1292,9 +3685,18 @@ void BaselineBANMac::handleMoreDataAtHub(BaselineMacPacket *pkt) {
      * if we don't, then we will not receive packets from that NID in the old slot, so no harm done.
      */
     if (currentSlot == lastTxAccessSlot[NID].scheduled || currentSlot == lastTxAccessSlot[NID].polled) {
-        if (nextFuturePollSlot <= beaconPeriodLength) {
-            trace() << "Hub handles more Data (" << pkt->getMoreData() << ") from NID: " << NID << " current slot: " << currentSlot;
-            reqToSendMoreData[NID] = pkt->getMoreData();
+        trace() << "Hub handles more Data (" << pkt->getMoreData() << ") from NID: " << NID << " current slot: " << currentSlot;
+        reqToSendMoreData[NID] = pkt->getMoreData();
+        moreDataNIDs.insert(NID);
+        /* A poll is only announced for a slot that is still ahead of us: the naive scheme's
+         * future poll slot, or a free slot (or the grant NID already has) for the others.
+         * Otherwise the demand waits for the next beacon period.
+         */
+        bool pollSlotAhead = naivePollingScheme ?
+                (nextFuturePollSlot > currentSlot && nextFuturePollSlot <= beaconPeriodLength) :
+                (hubPollTimers.grantOf(NID) != NULL ||
+                 scheduleManager.findFreeRun(1, max(currentSlot + 1, nextFuturePollSlot), beaconPeriodLength + 1) > 0);
+        if (pollSlotAhead) {
             // If an ack is required for the packet, the poll will be sent as an I_ACK_POLL
             if (pkt->getAckPolicy() == I_ACK_POLICY) {
                 sendIAckPoll = true;
@@ -1311,7 +3713,7 @@ void BaselineBANMac::timerFiredCallback(int index) {
     switch (index) {
         case CARRIER_SENSING: {
             // Specific logic for CARRIER_SENSING timer
-            if (!canFitTx()) {
+            if (!canFitTx() && !selectGapFillPacket()) {
                 attemptingToTX = false;
                 currentPacketCSFails++;
                 break;
@@ -1335,6 +3737,11 @@ void BaselineBANMac::timerFiredCallback(int index) {
             break;
         }
 
+        case SUPERFRAME_PLAN: {
+            runSuperframePlan();
+            break;
+        }
+
         case ACK_TIMEOUT: {
             trace() << "ACK timeout fired";
             waitingForACK = false;
@@ -1346,9 +3753,12 @@ void BaselineBANMac::timerFiredCallback(int index) {
             // check if we reached the max number and if so delete the packet
             if (currentPacketTransmissions + currentPacketCSFails == maxPacketTries) {
                 if (packetToBeSent->getFrameType() == DATA) {
-                    collectOutput("Data pkt breakdown", "Failed, No Ack");
+                    collectDataOutcome(packetToBeSent, "Failed, No Ack");
                 } else collectOutput("Mgmt & Ctrl pkt breakdown", "Failed, No Ack");
-                cancelAndDelete(packetToBeSent);
+                if (packetToBeSent->getFrameType() == DATA) recordLatency(packetToBeSent, LATENCY_DROPPED, currentAccessMode());
+                // A management frame with rounds left is parked by parkManagementForRetry(), not deleted
+                if (packetToBeSent->getFrameType() == DATA || !parkManagementForRetry(packetToBeSent))
+                    cancelAndDelete(packetToBeSent);
                 packetToBeSent = NULL;
                 currentPacketTransmissions = 0;
                 currentPacketCSFails = 0;
@@ -1359,51 +3769,66 @@ void BaselineBANMac::timerFiredCallback(int index) {
 
         case START_SLEEPING: {
             trace() << "State from " << macState << " to MAC_SLEEP";
-            macState = MAC_SLEEP;
-            toRadioLayer(createRadioCommand(SET_STATE, SLEEP));
-            isRadioSleeping = true;
+            setMacState(MAC_SLEEP);
+            sleepRadioIfWorthIt(timeToNextWakeup());
             isPollPeriod = false;
             break;
         }
 
         case START_SCHEDULED_TX_ACCESS: {
             trace() << "State from " << macState << " to MAC_FREE_TX_ACCESS (scheduled)";
-            macState = MAC_FREE_TX_ACCESS;
+            setMacState(MAC_FREE_TX_ACCESS);
             endTime = getClock() + (scheduledTxAccessEnd - scheduledTxAccessStart) * allocationSlotLength;
-            if (beaconPeriodLength > scheduledTxAccessEnd)
-                setTimer(START_SLEEPING, (scheduledTxAccessEnd - scheduledTxAccessStart) * allocationSlotLength);
+            if (beaconPeriodLength > scheduledTxAccessEnd && scheduledTxAccessEnd != scheduledRxAccessStart)
+                planAction(START_SLEEPING, (scheduledTxAccessEnd - scheduledTxAccessStart) * allocationSlotLength);
+            attemptTX();
+            break;
+        }
+
+        case START_CAP: {
+            // Nothing to send, keep sleeping until the next wakeup
+            if (packetToBeSent == NULL && TXBuffer.empty() && MgmtBuffer.empty()) {
+                if (macState == MAC_SLEEP) sleepRadioIfWorthIt(timeToNextWakeup());
+                break;
+            }
+            trace() << "State from " << macState << " to MAC_CAP";
+            setMacState(MAC_CAP);
+            endTime = frameStartTime + beaconPeriodLength * allocationSlotLength;
+            // The next beacon may not be ours to listen to
+            if (scheduledAccessPeriod > 1) planAction(START_SLEEPING, endTime - getClock());
             attemptTX();
             break;
         }
 
         case START_SCHEDULED_RX_ACCESS: {
             trace() << "State from " << macState << " to MAC_FREE_RX_ACCESS (scheduled)";
-            macState = MAC_FREE_RX_ACCESS;
-            toRadioLayer(createRadioCommand(SET_STATE, RX));
-            isRadioSleeping = false;
-            if (beaconPeriodLength > scheduledRxAccessEnd)
-                setTimer(START_SLEEPING, (scheduledRxAccessEnd - scheduledRxAccessStart) * allocationSlotLength);
+            setMacState(MAC_FREE_RX_ACCESS);
+            setRadioState(RX);
+            // We woke up a guard time early, stay until the end of the last RX slot
+            if (beaconPeriodLength > scheduledRxAccessEnd && scheduledRxAccessEnd != scheduledTxAccessStart)
+                planAction(START_SLEEPING, (scheduledRxAccessEnd - scheduledRxAccessStart) * allocationSlotLength + GUARD_TIME);
+            else cancelPlannedAction(START_SLEEPING);
             break;
         }
 
         case START_POSTED_ACCESS: {
             trace() << "State from " << macState << " to MAC_FREE_RX_ACCESS (post)";
-            macState = MAC_FREE_RX_ACCESS;
-            toRadioLayer(createRadioCommand(SET_STATE, RX));
-            isRadioSleeping = false;
+            setMacState(MAC_FREE_RX_ACCESS);
+            setRadioState(RX);
             // reset the timer for sleeping as needed
             if ((postedAccessEnd - 1) != beaconPeriodLength &&
                 postedAccessEnd != scheduledTxAccessStart && postedAccessEnd != scheduledRxAccessStart) {
-                setTimer(START_SLEEPING, allocationSlotLength);
-            } else cancelTimer(START_SLEEPING);
+                planAction(START_SLEEPING, allocationSlotLength);
+            } else cancelPlannedAction(START_SLEEPING);
             break;
         }
 
         case WAKEUP_FOR_BEACON: {
             trace() << "State from " << macState << " to MAC_BEACON_WAIT";
-            macState = MAC_BEACON_WAIT;
-            toRadioLayer(createRadioCommand(SET_STATE, RX));
-            isRadioSleeping = false;
+            setMacState(MAC_BEACON_WAIT);
+            // The beacon we wake up for is scheduledAccessPeriod beacons after the last one, hop to its channel
+            if (lastBeaconHopState >= 0) tuneToHopState((lastBeaconHopState + scheduledAccessPeriod) % hopCycleLength());
+            setRadioState(RX);
             isPollPeriod = false;
             break;
         }
@@ -1415,15 +3840,25 @@ void BaselineBANMac::timerFiredCallback(int index) {
         }
 
         case START_SETUP: {
-            macState = MAC_SETUP;
+            setMacState(MAC_SETUP);
+            // Listen for the next beacon on its channel
+            if (lastBeaconHopState >= 0) tuneToHopState((lastBeaconHopState + 1) % hopCycleLength());
             break;
         }
 
         case SEND_BEACON: {
+    emitSuperframeSamples();
+    // A slot length / beacon period change takes effect when its countdown ends, otherwise see if one is due
+    if (parameterChangeCountdown > 0 && --parameterChangeCountdown == 0) applyHubParameterChange();
+    else if (parameterChangeCountdown == 0 && (adaptiveSlotLength || adaptiveBeaconPeriod)) planHubParameterChange();
+    if (dynamicRAP) resizeRAP();
     trace() << "BEACON SEND, next beacon in " << beaconPeriodLength * allocationSlotLength;
     trace() << "State from " << macState << " to MAC_RAP";
-    macState = MAC_RAP;
-    setTimer(SEND_BEACON, beaconPeriodLength * allocationSlotLength);
+    setMacState(MAC_RAP);
+    // With beacon shifting the next beacon moves by the difference of the two shift offsets
+    int shiftPhase = beaconShiftPhase;
+    beaconShiftPhase = (beaconShiftPhase + 1) % beaconShiftingPhases;
+    setTimer(SEND_BEACON, beaconPeriodLength * allocationSlotLength + beaconShiftDelta(beaconShiftIndex, shiftPhase, 1));
     setTimer(HUB_SCHEDULED_ACCESS, RAP1Length * allocationSlotLength);
     endTime = getClock() + RAP1Length * allocationSlotLength;
 
@@ -1435,11 +3870,25 @@ void BaselineBANMac::timerFiredCallback(int index) {
     beaconPkt->setAllocationSlotLength((int)(allocationSlotLength * 1000));
     beaconPkt->setBeaconPeriodLength(beaconPeriodLength);
     beaconPkt->setRAP1Length(RAP1Length);
+    beaconPkt->setEAP1Length(EAP1Length);
+    beaconPkt->setCAPStart(CAPStart);
+    // Hop at the start of the beacon period and advertise the hopping pattern
+    if (channelHopping) {
+        hubHopState = (hubHopState + 1) % hopCycleLength();
+        tuneToHopState(hubHopState);
+    }
+    beaconPkt->setChannelHoppingState(channelHopping ? hubHopState : -1);
+    beaconPkt->setChannelHoppingDwell(beaconHopDwell);
+    beaconPkt->setBeaconShiftingSequenceIndex(beaconShiftIndex);
+    beaconPkt->setBeaconShiftingSequencePhase(shiftPhase);
     beaconPkt->setByteLength(BASELINEBAN_BEACON_SIZE);
+    beaconPkt->setParameterChangeCountdown(parameterChangeCountdown);
+    beaconPkt->setPendingAllocationSlotLength(pendingAllocationSlotLength);
+    beaconPkt->setPendingBeaconPeriodLength(pendingBeaconPeriodLength);
+    if (parameterChangeCountdown > 0) beaconPkt->setByteLength(beaconPkt->getByteLength() + BEACON_PARAMETER_CHANGE_SIZE);
+    addBeaconAssignments(beaconPkt);
 
-    toRadioLayer(beaconPkt);
-    toRadioLayer(createRadioCommand(SET_STATE, TX));
-    isRadioSleeping = false;
+    transmitToRadio(beaconPkt);
 
     // Read the long comment in sendPacket() to understand why we add 2*pTIFS
     setTimer(START_ATTEMPT_TX, (TX_TIME(beaconPkt->getByteLength()) + 2 * pTIFS));
@@ -1452,10 +3901,24 @@ void BaselineBANMac::timerFiredCallback(int index) {
     setTimer(INCREMENT_SLOT, allocationSlotLength);
     // Free slots for polls happen after RAP and scheduled access
     nextFuturePollSlot = currentFirstFreeSlot;
+    // Polls and posts granted in the previous superframe have expired
+    scheduleManager.releasePolls();
+    purgeManagement(POLL);
+    // Management frames that ran out of tries last beacon period get their next round
+    requeueParkedManagement();
+    hubPollTimers.clear();
+    activePollGrant.NID = BROADCAST_NID;
+    downlinkPostSlot.clear();
+    hubBeaconCount++;
+    offerDownlinkPosts();
+
+    // Pick this superframe's polling scheme from last superframe's demand
+    if (adaptivePolling && pollingEnabled) choosePollingScheme();
 
     // If implementing a naive polling scheme, we will send a bunch of future polls in the first free slot for polls
     if (naivePollingScheme && pollingEnabled && nextFuturePollSlot <= beaconPeriodLength) {
         setTimer(SEND_FUTURE_POLLS, (nextFuturePollSlot - 1) * allocationSlotLength);
+        scheduleManager.assign(BROADCAST_NID, SLOT_DOWNLINK, SLOT_PHASE_POLL, nextFuturePollSlot, nextFuturePollSlot + 1);
     }
     break;
 }
@@ -1463,7 +3926,7 @@ void BaselineBANMac::timerFiredCallback(int index) {
 
         case SEND_FUTURE_POLLS: {
     trace() << "State from " << macState << " to MAC_FREE_TX_ACCESS (send Future Polls)";
-    macState = MAC_FREE_TX_ACCESS;
+    setMacState(MAC_FREE_TX_ACCESS);
     endTime = getClock() + allocationSlotLength;
 
     // The current slot is used to TX the future polls, so we have 1 less slot available
@@ -1477,7 +3940,8 @@ void BaselineBANMac::timerFiredCallback(int index) {
     if (totalRequests == 0) break;
 
     for (int nid = 0; nid < 256; nid++) {
-        if (reqToSendMoreData[nid] > 0) {
+        // A node wakes up for one future poll or post at a time, one with a post is polled next time
+        if (reqToSendMoreData[nid] > 0 && downlinkPostSlot.find(nid) == downlinkPostSlot.end()) {
             // A very simple assignment scheme. It can leave several slots unused
             int slotsGiven = floor(((float)reqToSendMoreData[nid] / (float)totalRequests) * availableSlots);
             if (slotsGiven == 0) continue;
@@ -1486,6 +3950,7 @@ void BaselineBANMac::timerFiredCallback(int index) {
             t.slotsGiven = slotsGiven;
             t.endSlot = nextPollStart + slotsGiven - 1;
             hubPollTimers.push(t);
+            scheduleManager.assign(nid, SLOT_UPLINK, SLOT_PHASE_POLL, nextPollStart, t.endSlot + 1);
             reqToSendMoreData[nid] = 0; // Reset the requested resources
 
             // Create the future POLL packet and buffer it
@@ -1502,12 +3967,13 @@ void BaselineBANMac::timerFiredCallback(int index) {
             // Collect statistics or do other necessary actions
             // collectOutput("Polls given", nid);
 
-            MgmtBuffer.push(pollPkt);
+            pushManagement(pollPkt);
         }
     }
 
     // The first poll will be sent one slot after the current one.
-    if (!hubPollTimers.empty()) setTimer(SEND_POLL, allocationSlotLength);
+    armPollTimer();
+    sampleQueues();
     // TX all the future POLL packets created
     attemptTX();
     break;
@@ -1519,11 +3985,10 @@ case SEND_POLL: {
         break;
     }
     trace() << "State from " << macState << " to MAC_FREE_RX_ACCESS (Poll)";
-    macState = MAC_FREE_RX_ACCESS;
+    setMacState(MAC_FREE_RX_ACCESS);
 
     // We set the state to RX but we also need to send the POLL message.
-    TimerInfo t = hubPollTimers.front();
-    int slotsGiven = t.slotsGiven;
+    TimerInfo t = hubPollTimers.top();
     BaselineMacPacket *pollPkt = new BaselineMacPacket("BaselineBAN Immediate Poll", MAC_LAYER_PACKET);
     setHeaderFields(pollPkt, N_ACK_POLICY, MANAGEMENT, POLL);
     pollPkt->setNID(t.NID);
@@ -1532,83 +3997,76 @@ case SEND_POLL: {
     pollPkt->setMoreData(0);
     pollPkt->setByteLength(BASELINEBAN_HEADER_SIZE);
 
-    toRadioLayer(pollPkt);
-    toRadioLayer(createRadioCommand(SET_STATE, TX));
-    isRadioSleeping = false;
+    transmitToRadio(pollPkt);
 
     collectOutput("var stats", "poll slots given", t.slotsGiven);
     trace() << "POLL for NID: " << t.NID << ", ending at slot: " << t.endSlot << ", lasting: " << t.slotsGiven << " slots";
     hubPollTimers.pop();
+    activePollGrant = t;
+    sampleQueues();
 
-    // If there is another poll, then it will come after this one, so scheduling the timer is easy
-    if (hubPollTimers.size() > 0) setTimer(SEND_POLL, slotsGiven * allocationSlotLength);
+    // The next grant may start right after this one or later, after a gap
+    armPollTimer();
     break;
 }
 
 
         case INCREMENT_SLOT: {
+            // RAP contention statistics: close the slot that ended, sense the channel at the start of the next
+            if (dynamicRAP && currentSlot <= RAP1Length) closeRAPSlot();
             currentSlot++;
+            if (dynamicRAP && currentSlot <= RAP1Length) sampleRAPSlot();
             if (currentSlot < beaconPeriodLength) setTimer(INCREMENT_SLOT, allocationSlotLength);
             break;
         }
 
         case HUB_SCHEDULED_ACCESS: {
-    trace() << "State from " << macState << " to MAC_FREE_RX_ACCESS (hub)";
-    macState = MAC_FREE_RX_ACCESS;
-
-    // We should look at the schedule and set up timers to get in and out
-    // of MAC_FREE_RX_ACCESS, MAC_FREE_TX_ACCESS, and finally MAC_SLEEP
-
-    // Check if there are any scheduled TX or RX slots for the hub
-    bool hasScheduledTX = false;
-    bool hasScheduledRX = false;
-
-    // Assume you have some data structures to store the schedule information
-    // and check if the hub has any scheduled TX or RX slots based on its NID
-    int hubNID = getHubNID(); // Replace this with the actual NID of the hub
-
-    // Check for scheduled TX slots for the hub
-    if (hasScheduledTXSlot(hubNID)) {
-        hasScheduledTX = true;
-
-        // Get the start and end slots of the scheduled TX access
-        int scheduledTXStart = getScheduledTXStartSlot(hubNID);
-        int scheduledTXEnd = getScheduledTXEndSlot(hubNID);
-
-        // Set the timer for entering the scheduled TX access
-        simtime_t scheduledTXStartTime = frameStartTime + (scheduledTXStart - 1) * allocationSlotLength;
-        setTimer(START_SCHEDULED_TX_ACCESS, scheduledTXStartTime - getClock());
-
-        // Set the timer for exiting the scheduled TX access
-        simtime_t scheduledTXEndTime = frameStartTime + scheduledTXEnd * allocationSlotLength;
-        setTimer(END_SCHEDULED_TX_ACCESS, scheduledTXEndTime - getClock());
+    /* Walk the superframe layout kept by scheduleManager. The hub stays awake for
+     * runs of allocated slots (RX for uplink, TX for downlink) and sleeps through
+     * unallocated ones. Each run end re-arms this timer to look at the next run.
+     */
+    int slot = (int)round(SIMTIME_DBL(getClock() - frameStartTime) / allocationSlotLength) + 1;
+    int nextSlot = scheduleManager.nextAllocatedSlot(slot);
+    if (nextSlot > beaconPeriodLength) {
+        // Nothing else is allocated in this superframe, SEND_BEACON will wake us up
+        trace() << "State from " << macState << " to MAC_SLEEP (until next beacon)";
+        setMacState(MAC_SLEEP);
+        sleepRadioIfWorthIt(frameStartTime + beaconPeriodLength * allocationSlotLength - getClock());
+        break;
     }
-
-    // Check for scheduled RX slots for the hub
-    if (hasScheduledRXSlot(hubNID)) {
-        hasScheduledRX = true;
-
-        // Get the start and end slots of the scheduled RX access
-        int scheduledRXStart = getScheduledRXStartSlot(hubNID);
-        int scheduledRXEnd = getScheduledRXEndSlot(hubNID);
-
-        // Set the timer for entering the scheduled RX access
-        simtime_t scheduledRXStartTime = frameStartTime + (scheduledRXStart - 1) * allocationSlotLength;
-        setTimer(START_SCHEDULED_RX_ACCESS, scheduledRXStartTime - getClock());
-
-        // Set the timer for exiting the scheduled RX access
-        simtime_t scheduledRXEndTime = frameStartTime + scheduledRXEnd * allocationSlotLength;
-        setTimer(END_SCHEDULED_RX_ACCESS, scheduledRXEndTime - getClock());
+    if (nextSlot > slot) {
+        trace() << "State from " << macState << " to MAC_SLEEP (slots " << slot << "-" << nextSlot - 1 << " unallocated)";
+        setMacState(MAC_SLEEP);
+        sleepRadioIfWorthIt(frameStartTime + (nextSlot - 1) * allocationSlotLength - getClock());
+        setTimer(HUB_SCHEDULED_ACCESS, frameStartTime + (nextSlot - 1) * allocationSlotLength - getClock());
+        break;
     }
 
-    // If there are no scheduled slots, the hub should directly go to sleep
-    if (!hasScheduledTX && !hasScheduledRX) {
-        trace() << "State from " << macState << " to MAC_SLEEP";
-        macState = MAC_SLEEP;
-        toRadioLayer(createRadioCommand(SET_STATE, SLEEP));
-        isRadioSleeping = true;
+    const SlotOwner &owner = scheduleManager.owner(slot);
+    // Runs end where the owner changes, whether we send depends on the owner being awake
+    int runEnd = scheduleManager.runEnd(slot);
+    if (owner.direction == SLOT_DOWNLINK && owner.NID != BROADCAST_NID && !nodeAwakeThisSuperframe(owner.NID)) {
+        // The owner sleeps through this beacon period (wakeup interval above one), so do we through its slots
+        trace() << "State from " << macState << " to MAC_SLEEP (NID " << owner.NID << " asleep, slots " << slot << "-" << runEnd - 1 << ")";
+        setMacState(MAC_SLEEP);
+        sleepRadioIfWorthIt(frameStartTime + (runEnd - 1) * allocationSlotLength - getClock());
+        if (runEnd <= beaconPeriodLength)
+            setTimer(HUB_SCHEDULED_ACCESS, frameStartTime + (runEnd - 1) * allocationSlotLength - getClock());
+        break;
     }
-
+    if (owner.direction == SLOT_DOWNLINK) {
+        trace() << "State from " << macState << " to MAC_FREE_TX_ACCESS (hub, slots " << slot << "-" << runEnd - 1 << ")";
+        setMacState(MAC_FREE_TX_ACCESS);
+        endTime = frameStartTime + (runEnd - 1) * allocationSlotLength;
+        attemptTX();
+    } else {
+        trace() << "State from " << macState << " to MAC_FREE_RX_ACCESS (hub, slots " << slot << "-" << runEnd - 1 << ")";
+        setMacState(MAC_FREE_RX_ACCESS);
+        setRadioState(RX);
+    }
+    collectOutput("var stats", "hub awake slots", runEnd - slot);
+    if (runEnd <= beaconPeriodLength)
+        setTimer(HUB_SCHEDULED_ACCESS, frameStartTime + (runEnd - 1) * allocationSlotLength - getClock());
     break;
 }
 
@@ -1617,82 +4075,45 @@ case SEND_POLL: {
 
 
 
-// Helper function to check if the hub has any scheduled TX slots
+// The hub transmits in downlink allocations
 bool BaselineBANMac::hasScheduledTXSlot(int hubNID) {
-    // Replace this with your actual implementation to check if the hub
-    // with the given NID has any scheduled TX slots.
-    // Return true if there are scheduled TX slots, false otherwise.
-    // You can use your data structures to store and manage the schedule information.
-    // Example:
-    // return scheduleManager.hasScheduledTXSlots(hubNID);
-    // where scheduleManager is an instance of your schedule management class.
-    // Make sure to implement the corresponding methods in your schedule manager class.
-    return false;
+    return scheduleManager.hasSlots(SLOT_DOWNLINK);
 }
 
-// Helper function to get the start slot of the scheduled TX access for the hub
 int BaselineBANMac::getScheduledTXStartSlot(int hubNID) {
-    // Replace this with your actual implementation to get the start slot
-    // of the scheduled TX access for the hub with the given NID.
-    // Return the start slot number.
-    // You can use your data structures to store and manage the schedule information.
-    // Example:
-    // return scheduleManager.getScheduledTXStartSlot(hubNID);
-    // where scheduleManager is an instance of your schedule management class.
-    // Make sure to implement the corresponding methods in your schedule manager class.
-    return 0;
+    return scheduleManager.firstSlot(SLOT_DOWNLINK);
 }
 
-// Helper function to get the end slot of the scheduled TX access for the hub
 int BaselineBANMac::getScheduledTXEndSlot(int hubNID) {
-    // Replace this with your actual implementation to get the end slot
-    // of the scheduled TX access for the hub with the given NID.
-    // Return the end slot number.
-    // You can use your data structures to store and manage the schedule information.
-    // Example:
-    // return scheduleManager.getScheduledTXEndSlot(hubNID);
-    // where scheduleManager is an instance of your schedule management class.
-    // Make sure to implement the corresponding methods in your schedule manager class.
-    return 0;
+    return scheduleManager.endSlot(SLOT_DOWNLINK);
 }
 
-// Helper function to check if the hub has any scheduled RX slots
+// The hub receives in uplink allocations
 bool BaselineBANMac::hasScheduledRXSlot(int hubNID) {
-    // Replace this with your actual implementation to check if the hub
-    // with the given NID has any scheduled RX slots.
-    // Return true if there are scheduled RX slots, false otherwise.
-    // You can use your data structures to store and manage the schedule information.
-    // Example:
-    // return scheduleManager.hasScheduledRXSlots(hubNID);
-    // where scheduleManager is an instance of your schedule management class.
-    // Make sure to implement the corresponding methods in your schedule manager class.
-    return false;
+    return scheduleManager.hasSlots(SLOT_UPLINK);
 }
 
-// Helper function to get the start slot of the scheduled RX access for the hub
 int BaselineBANMac::getScheduledRXStartSlot(int hubNID) {
-    // Replace this with your actual implementation to get the start slot
-    // of the scheduled RX access for the hub with the given NID.
-    // Return the start slot number.
-    // You can use your data structures to store and manage the schedule information.
-    // Example:
-    // return scheduleManager.getScheduledRXStartSlot(hubNID);
-    // where scheduleManager is an instance of your schedule management class.
-    // Make sure to implement the corresponding methods in your schedule manager class.
-    return 0;
+    return scheduleManager.firstSlot(SLOT_UPLINK);
 }
 
-// Helper function to get the end slot of the scheduled RX access for the hub
 int BaselineBANMac::getScheduledRXEndSlot(int hubNID) {
-    // Replace this with your actual implementation to get the end slot
-    // of the scheduled RX access for the hub with the given NID.
-    // Return the end slot number.
-    // You can use your data structures to store and manage the schedule information.
-    // Example:
-    // return scheduleManager.getScheduledRXEndSlot(hubNID);
-    // where scheduleManager is an instance of your schedule management class.
-    // Make sure to implement the corresponding methods in your schedule manager class.
-    return 0;
+    return scheduleManager.endSlot(SLOT_UPLINK);
+}
+
+// Access mode we are in right now, used to classify latency samples
+int BaselineBANMac::currentAccessMode() {
+    if (macState == MAC_RAP || macState == MAC_EAP || macState == MAC_CAP) return ACCESS_RAP;
+    if (isHub) {
+        const SlotOwner &owner = scheduleManager.owner(currentSlot);
+        int phase = owner.phase;
+        if (phase == SLOT_PHASE_POLL && owner.direction == SLOT_DOWNLINK) return ACCESS_POSTED;
+        if (phase == SLOT_PHASE_POLL) return ACCESS_POLLED;
+        if (phase == SLOT_PHASE_SCHEDULED) return ACCESS_SCHEDULED;
+        return ACCESS_RAP;
+    }
+    if (macState == MAC_FREE_RX_ACCESS) return ACCESS_POSTED;
+    return isPollPeriod ? ACCESS_POLLED : ACCESS_SCHEDULED;
 }
 
 
@@ -1734,8 +4155,7 @@ void BaselineBANMac::fromRadioLayer(cPacket *pkt, double rssi, double lqi) {
          ackPacket->setSequenceNumber(getNextSeqNumber() + HIGH_PRIORITY_OFFSET);
          ackPacket->setFRAG(ackPacket->getFRAG() + FRAG_OFFSET);
 
-         toRadioLayer(ackPacket);     
-         toRadioLayer(createRadioCommand(SET_STATE,TX));
+         transmitToRadio(ackPacket);
          setTimer(START_ATTEMPT_TX, (TX_TIME(BASELINEBAN_HEADER_SIZE) + pTIFS) );
                  
         collectOutput("ACK latency", "Low");  
@@ -1746,8 +4166,7 @@ void BaselineBANMac::fromRadioLayer(cPacket *pkt, double rssi, double lqi) {
           ackPacket->setFrameSubtype(LOW_PRIORITY); 
           ackPacket->setSequenceNumber(getNextSeqNumber());    
           
-          toRadioLayer(ackPacket);   
-          toRadioLayer(createRadioCommand(SET_STATE,TX)); 
+          transmitToRadio(ackPacket);
           setTimer(START_ATTEMPT_TX, (TX_TIME(BASELINEBAN_HEADER_SIZE) + 2*pTIFS) );
       
           collectOutput("ACK latency", "Default");       
@@ -2042,6 +4461,7 @@ void BaselineBANMac::attemptTX() {
             collectOutput("pkt breakdown", "Medium/low priority failed");     
         }
               
+        managementRoundsLeft.erase(packetToBeSent);
         cancelAndDelete(packetToBeSent);
 		packetToBeSent = NULL;
 		currentPacketTransmissions = 0;
@@ -2106,11 +4526,17 @@ void BaselineBANMac::sendPacket() {
         }   
          
          
-        toRadioLayer(packetToBeSent->dup());  
-        toRadioLayer(createRadioCommand(SET_STATE,TX));
+        // Through transmitToRadio(), so the radio state and energy accounting follow data TX too
+        transmitToRadio(packetToBeSent->dup());
          
     } 
     else {  
+        // No ACK to wait for, the radio owns the frame from here on
+        managementRoundsLeft.erase(packetToBeSent);
+        transmitToRadio(packetToBeSent);
+        packetToBeSent = NULL;
+        currentPacketTransmissions = 0;
+        currentPacketCSFails = 0;
       
         if (priority == HIGH_PRIORITY) {
             setTimer(START_ATTEMPT_TX, SHORT_WAIT);  
@@ -2185,8 +4611,8 @@ void BaselineBANMac::handlePoll(BaselineMacPacket *pkt) {
             // reset the timer for sleeping as needed
             if (endPolledAccessSlot != beaconPeriodLength &&
             (endPolledAccessSlot+1) != scheduledTxAccessStart && (endPolledAccessSlot+1) != scheduledRxAccessStart){
-                setTimer(START_SLEEPING, endTime - getClock());
-            }else cancelTimer(START_SLEEPING);
+                planAction(START_SLEEPING, endTime - getClock());
+            }else cancelPlannedAction(START_SLEEPING);
 
             int currentSlotEstimate = round(SIMTIME_DBL(getClock()-frameStartTime)/allocationSlotLength)+1;
             if (currentSlotEstimate-1 > beaconPeriodLength) trace() << "WARNING: currentSlotEstimate= "<< currentSlotEstimate;
@@ -1,3 +1,6 @@
+// Size of the per NID hub arrays (lastTxAccessSlot, reqToSendMoreData), indexed by connected NID
+static const int HUB_NID_TABLE_SIZE = 216;
+
 void BaselineBANMac::startup() {
 	isHub = par("isHub");
 	if (isHub) {
@@ -9,9 +12,9 @@ void BaselineBANMac::startup() {
 		RAP1Length = par("RAP1Length");
 		currentFirstFreeSlot = RAP1Length + 1;
 		setTimer(SEND_BEACON, 0);
-		lastTxAccessSlot = new AccessSlot[216];
-		reqToSendMoreData = new int[216];
-		for (int i = 0; i < 216; i++) {
+		lastTxAccessSlot = new AccessSlot[HUB_NID_TABLE_SIZE];
+		reqToSendMoreData = new int[HUB_NID_TABLE_SIZE];
+		for (int i = 0; i < HUB_NID_TABLE_SIZE; i++) {
 			lastTxAccessSlot[i].scheduled = 0;
 			lastTxAccessSlot[i].polled = 0;
 			reqToSendMoreData[i] = 0;
@@ -22,7 +25,6 @@ void BaselineBANMac::startup() {
 		capSlotLength = (double) par("capSlotLength")/1000.0;
 		numEapSlots = par("numEapSlots");
 		numCapSlots = par("numCapSlots");
-		currentPhase = EAP_PHASE; // start with EAP phase
 
 		// modify existing variables to account for EAP and CAP packets
 		contentionSlotLength = (double) par("contentionSlotLength")/1000.0; // convert msec to sec;
@@ -42,14 +44,14 @@ void BaselineBANMac::startup() {
 		// initialize phase-specific variables
 		currentEapSlot = 0;
 		currentCapSlot = 0;
-		numPacketsInEapPhase = 0;
-		numPacketsInCapPhase = 0;
 
 	} else {
 		connectedHID = UNCONNECTED;
 		connectedNID = UNCONNECTED;
-		unconnectedNID = 1 + genk_intrand(0,14);    //we select random unconnected NID
-		trace() << "Selected random unconnected NID " << unconnectedNID;
+		hashedJoin = par("hashedJoin");
+		joinNIDCollisions = 0;
+		unconnectedNID = pickUnconnectedNID();    // random, or derived from our address with hashedJoin
+		trace() << "Selected unconnected NID " << unconnectedNID;
 		scheduledAccessLength = par("scheduledAccessLength");
 		scheduledAccessPeriod = par("scheduledAccessPeriod");
 		pastSyncIntervalNominal = false;
@@ -73,10 +75,6 @@ void BaselineBANMac::startup() {
 	currentSlot = -1;		// only used by Hub
 	nextFuturePollSlot = -1;	// only used by Hub
 
-	// initialize variables for EAP and CAP phases
-	numPacketsInEapPhase = 0;
-	numPacketsInCapPhase = 0;
-
 	// declare output statistics
 	declareOutput("Data pkt breakdown");
 	declareOutput("Mgmt & Ctrl pkt breakdown");
@@ -89,22 +87,17 @@ void BaselineBANMac::startup() {
 void BaselineBANMac::timerFiredCallback(int index) {
 	switch (index) {
         case TX_ATTEMPT: {
-            if (!canFitTx()) {
+            if (!canFitTx() && !selectGapFillPacket()) {
                 attemptingToTX = false;
                 currentPacketCSFails++;
                 break;
             }
 
-            if (currentPhase == EAP_PHASE) {
-                if (numPacketsInEapPhase == 0) {
-                    currentPhase = CAP_PHASE;
-                    break;
-                }
-            } else if (currentPhase == CAP_PHASE) {
-                if (numPacketsInCapPhase == 0) {
-                    currentPhase = EAP_PHASE;
-                    break;
-                }
+            // Outside scheduled access, the phase of the current slot decides who may contend
+            if (macState != MAC_FREE_TX_ACCESS && !mayContend(packetToBeSent)) {
+                attemptingToTX = false;
+                attemptContention();
+                break;
             }
 
             sendPacket();
@@ -137,33 +130,15 @@ void BaselineBANMac::timerFiredCallback(int index) {
             if (currentPacketTransmissions + currentPacketCSFails == maxPacketTries) {
                 // collect statistics
                 if (packetToBeSent->getFrameType() == DATA) {
-                    collectOutput("Data pkt breakdown", "Failed, No Ack");
+                    collectDataOutcome(packetToBeSent, "Failed, No Ack");
                 } else collectOutput("Mgmt & Ctrl pkt breakdown", "Failed, No Ack");
-                cancelAndDelete(packetToBeSent);
+                if (packetToBeSent->getFrameType() == DATA) recordLatency(packetToBeSent, LATENCY_DROPPED, currentAccessMode());
+                // A management frame with rounds left is parked by parkManagementForRetry(), not deleted
+                if (packetToBeSent->getFrameType() == DATA || !parkManagementForRetry(packetToBeSent))
+                    cancelAndDelete(packetToBeSent);
                 packetToBeSent = NULL;
                 currentPacketTransmissions = 0;
                 currentPacketCSFails = 0;
-                if (currentPhase == EAP_PHASE) {
-                    numPacketsInEapPhase--;
-                } else if (currentPhase == CAP_PHASE) {
-                    numPacketsInCapPhase--;
-                }
-                if (numPacketsInEapPhase == 0 && numPacketsInCapPhase == 0) {
-                    currentPhase = EAP_PHASE;
-                    break;
-                }
-            }
-
-            if (currentPhase == EAP_PHASE) {
-                if (numPacketsInEapPhase == 0) {
-                    currentPhase = CAP_PHASE;
-                    break;
-                }
-            } else if (currentPhase == CAP_PHASE) {
-                if (numPacketsInCapPhase == 0) {
-                    currentPhase = EAP_PHASE;
-                    break;
-                }
             }
 
             attemptTX();
@@ -172,68 +147,39 @@ void BaselineBANMac::timerFiredCallback(int index) {
 
         case START_SLEEPING: {
             trace() << "State from "<< macState << " to MAC_SLEEP";
-            macState = MAC_SLEEP;
-            toRadioLayer(createRadioCommand(SET_STATE,SLEEP));   isRadioSleeping = true;
+            setMacState(MAC_SLEEP);
+            sleepRadioIfWorthIt(timeToNextWakeup());
             isPollPeriod = false;
-
-            if (currentPhase == EAP_PHASE) {
-                numPacketsInEapPhase = numPacketsToSendEapPhase;
-                currentPacketRetries = 0;
-                currentPacketCSFails = 0;
-                currentPacketTransmissions = 0;
-                currentPhase = CAP_PHASE;
-                setTimer(TX_ATTEMPT, 0);
-            } else if (currentPhase == CAP_PHASE) {
-                numPacketsInCapPhase = numPacketsToSendCapPhase;
-                currentPacketRetries = 0;
-                currentPacketCSFails = 0;
-                currentPacketTransmissions = 0;
-                currentPhase = EAP_PHASE;
-                setTimer(TX_ATTEMPT, 0);
-            }
-
             break;
         }
 
         case START_SCHEDULED_TX_ACCESS: {
             trace() << "State from "<< macState << " to MAC_FREE_TX_ACCESS (scheduled)";
-            macState = MAC_FREE_TX_ACCESS;
+            setMacState(MAC_FREE_TX_ACCESS);
             endTime = getClock() + (scheduledTxAccessEnd - scheduledTxAccessStart) * allocationSlotLength;
             if (beaconPeriodLength > scheduledTxAccessEnd) {
-                setTimer(START_SLEEPING, (scheduledTxAccessEnd - scheduledTxAccessStart) * allocationSlotLength);
+                planAction(START_SLEEPING, (scheduledTxAccessEnd - scheduledTxAccessStart) * allocationSlotLength);
             }
-
-            if (currentPhase == EAP_PHASE) {
-                if (numPacketsInEapPhase == 0) {
-                    currentPhase = CAP_PHASE;
-                    break;
-                }
-            } else if (currentPhase == CAP_PHASE) {
-                if (numPacketsInCapPhase == 0) {
-                    currentPhase = EAP_PHASE;
-                    break;
-                }
-            }
-
             attemptTX();
             break;
         }
  
-        // unchanged
         case START_SCHEDULED_RX_ACCESS: {
 			trace() << "State from "<< macState << " to MAC_FREE_RX_ACCESS (scheduled)";
-			macState = MAC_FREE_RX_ACCESS;
-			toRadioLayer(createRadioCommand(SET_STATE,RX));  isRadioSleeping = false;
-			if (beaconPeriodLength > scheduledRxAccessEnd)
-				setTimer(START_SLEEPING, (scheduledRxAccessEnd - scheduledRxAccessStart) * allocationSlotLength);
+			setMacState(MAC_FREE_RX_ACCESS);
+			setRadioState(RX);
+			// We woke up a guard time early, stay until the end of the last RX slot
+			if (beaconPeriodLength > scheduledRxAccessEnd && scheduledRxAccessEnd != scheduledTxAccessStart)
+				planAction(START_SLEEPING, (scheduledRxAccessEnd - scheduledRxAccessStart) * allocationSlotLength + GUARD_TIME);
+			else cancelPlannedAction(START_SLEEPING);
 			break;
 		}
 
         // unchanged
         case START_POSTED_ACCESS: {
 			trace() << "State from "<< macState << " to MAC_FREE_RX_ACCESS (post)";
-			macState = MAC_FREE_RX_ACCESS;
-			toRadioLayer(createRadioCommand(SET_STATE,RX));  isRadioSleeping = false;
+			setMacState(MAC_FREE_RX_ACCESS);
+			setRadioState(RX);
 			// reset the timer for sleeping as needed
 			if ((postedAccessEnd-1) != beaconPeriodLength &&
 				postedAccessEnd != scheduledTxAccessStart && postedAccessEnd != scheduledRxAccessStart){
@@ -241,32 +187,44 @@ void BaselineBANMac::timerFiredCallback(int index) {
 				//setTimer(START_SLEEPING, frameStartTime + ((postedAccessEnd-1) * allocationSlotLength) - getClock());
 				//setTimer(START_SLEEPING, (postedAccessEnd-postedAccessStart)* allocationSlotLength);
 				// but this is simpler, since the duration is always 1 slot
-				setTimer(START_SLEEPING, allocationSlotLength);
-			}else cancelTimer(START_SLEEPING);
+				planAction(START_SLEEPING, allocationSlotLength);
+			}else cancelPlannedAction(START_SLEEPING);
 			break;
 		}
 
         // unchanged
         case WAKEUP_FOR_BEACON: {
 			trace() << "State from "<< macState << " to MAC_BEACON_WAIT";
-			macState = MAC_BEACON_WAIT;
-			toRadioLayer(createRadioCommand(SET_STATE,RX));  isRadioSleeping = false;
+			setMacState(MAC_BEACON_WAIT);
+			// The beacon we wake up for is scheduledAccessPeriod beacons after the last one, hop to its channel
+			if (lastBeaconHopState >= 0) tuneToHopState((lastBeaconHopState + scheduledAccessPeriod) % hopCycleLength());
+			setRadioState(RX);
 			isPollPeriod = false;
 			break;
 		}
 
         case START_SETUP: {
-			macState = MAC_SETUP;
+			setMacState(MAC_SETUP);
+			// Listen for the next beacon on its channel
+			if (lastBeaconHopState >= 0) tuneToHopState((lastBeaconHopState + 1) % hopCycleLength());
 			break;
 		}
 
         // The rest of the timers are specific to a Hub
 		case SEND_BEACON: {
+			emitSuperframeSamples();
+			// A slot length / beacon period change takes effect when its countdown ends, otherwise see if one is due
+			if (parameterChangeCountdown > 0 && --parameterChangeCountdown == 0) applyHubParameterChange();
+			else if (parameterChangeCountdown == 0 && (adaptiveSlotLength || adaptiveBeaconPeriod)) planHubParameterChange();
+			if (dynamicRAP) resizeRAP();
 			trace() << "BEACON SEND, next beacon in " << beaconPeriodLength * allocationSlotLength;
 			trace() << "State from "<< macState << " to MAC_RAP";
-			macState = MAC_RAP;
+			setMacState(MAC_RAP);
 			// We should provide for the case of the Hub sleeping. Here we ASSUME it is always ON!
-			setTimer(SEND_BEACON, beaconPeriodLength * allocationSlotLength);
+			// With beacon shifting the next beacon moves by the difference of the two shift offsets
+			int shiftPhase = beaconShiftPhase;
+			beaconShiftPhase = (beaconShiftPhase + 1) % beaconShiftingPhases;
+			setTimer(SEND_BEACON, beaconPeriodLength * allocationSlotLength + beaconShiftDelta(beaconShiftIndex, shiftPhase, 1));
 			setTimer(HUB_SCHEDULED_ACCESS, RAP1Length * allocationSlotLength);
 			// the hub has to set its own endTime
 			endTime = getClock() + RAP1Length * allocationSlotLength;
@@ -278,10 +236,25 @@ void BaselineBANMac::timerFiredCallback(int index) {
 			beaconPkt->setAllocationSlotLength((int)(allocationSlotLength*1000));
 			beaconPkt->setBeaconPeriodLength(beaconPeriodLength);
 			beaconPkt->setRAP1Length(RAP1Length);
+			beaconPkt->setEAP1Length(EAP1Length);
+			beaconPkt->setCAPStart(CAPStart);
+			// Hop at the start of the beacon period and advertise the hopping pattern
+			if (channelHopping) {
+				hubHopState = (hubHopState + 1) % hopCycleLength();
+				tuneToHopState(hubHopState);
+			}
+			beaconPkt->setChannelHoppingState(channelHopping ? hubHopState : -1);
+			beaconPkt->setChannelHoppingDwell(beaconHopDwell);
+			beaconPkt->setBeaconShiftingSequenceIndex(beaconShiftIndex);
+			beaconPkt->setBeaconShiftingSequencePhase(shiftPhase);
 			beaconPkt->setByteLength(BASELINEBAN_BEACON_SIZE);
+			beaconPkt->setParameterChangeCountdown(parameterChangeCountdown);
+			beaconPkt->setPendingAllocationSlotLength(pendingAllocationSlotLength);
+			beaconPkt->setPendingBeaconPeriodLength(pendingBeaconPeriodLength);
+			if (parameterChangeCountdown > 0) beaconPkt->setByteLength(beaconPkt->getByteLength() + BEACON_PARAMETER_CHANGE_SIZE);
+			addBeaconAssignments(beaconPkt);
 
-			toRadioLayer(beaconPkt);
-			toRadioLayer(createRadioCommand(SET_STATE,TX));  isRadioSleeping = false;
+			transmitToRadio(beaconPkt);
 
 			// read the long comment in sendPacket() to understand why we add 2*pTIFS
 			setTimer(START_ATTEMPT_TX, (TX_TIME(beaconPkt->getByteLength()) + 2*pTIFS));
@@ -294,15 +267,31 @@ void BaselineBANMac::timerFiredCallback(int index) {
 			setTimer(INCREMENT_SLOT, allocationSlotLength);
 			// free slots for polls happen after RAP and scheduled access
 			nextFuturePollSlot = currentFirstFreeSlot;
+			// polls and posts granted in the previous superframe have expired
+			scheduleManager.releasePolls();
+			purgeManagement(POLL);
+			// management frames that ran out of tries last beacon period get their next round
+			requeueParkedManagement();
+			hubPollTimers.clear();
+			activePollGrant.NID = BROADCAST_NID;
+			downlinkPostSlot.clear();
+			hubBeaconCount++;
+			offerDownlinkPosts();
+
+			// pick this superframe's polling scheme from last superframe's demand
+			if (adaptivePolling && pollingEnabled) choosePollingScheme();
+
 			// if implementing a naive polling scheme, we will send a bunch of future polls in the fist free slot for polls
-			if (naivePollingScheme && pollingEnabled && nextFuturePollSlot <= beaconPeriodLength)
+			if (naivePollingScheme && pollingEnabled && nextFuturePollSlot <= beaconPeriodLength) {
 				setTimer(SEND_FUTURE_POLLS, (nextFuturePollSlot-1) * allocationSlotLength);
+				scheduleManager.assign(BROADCAST_NID, SLOT_DOWNLINK, SLOT_PHASE_POLL, nextFuturePollSlot, nextFuturePollSlot + 1);
+			}
 			break;
 		}
 
         case SEND_FUTURE_POLLS: {
             trace() << "State from "<< macState << " to MAC_FREE_TX_ACCESS (send Future Polls)";
-            macState = MAC_FREE_TX_ACCESS;
+            setMacState(MAC_FREE_TX_ACCESS);
             // when we are in a state that we can TX, we should *always* set endTime
             endTime = getClock() + allocationSlotLength;
 